@@ -2,6 +2,571 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cmath>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <cstddef>
+#include <new>
+#include <cerrno>
+#include <algorithm>
+#include <functional>
+#include <tuple>
+#include <fcntl.h>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// compressed input: link with -lz, and with -lzstd where <zstd.h> is available.
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define KALEIDOSCOPE_HAVE_ZLIB 1
+#endif
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define KALEIDOSCOPE_HAVE_ZSTD 1
+#endif
+
+// hardware cache-miss counters for --bench-engines.
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define KALEIDOSCOPE_HAVE_PERF 1
+#endif
+
+// executable memory for the copy-and-patch JIT, whose stencils are x86-64 machine code.
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define KALEIDOSCOPE_HAVE_JIT 1
+#endif
+
+// self checks such as --check-steady-state replace the global operator new with a counting one, so they
+// are only compiled in with -DKALEIDOSCOPE_SELF_CHECKS and never reach the shipped binary.
+
+using Clock = std::chrono::steady_clock;
+
+//-----------------------------------------------------------------------------------
+// Input
+//-----------------------------------------------------------------------------------
+
+// InputSource - where the lexer's bytes come from.
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    // read - fill buf with up to len bytes; returns 0 at the end of the input.
+    virtual size_t read(char *buf, size_t len) = 0;
+};
+
+// FdSource - reads a file descriptor, e.g. standard input or a script file.
+// For files, the kernel is asked to read the next window ahead while the current one is lexed.
+class FdSource : public InputSource {
+    int fd;
+    off_t offset = 0;
+
+public:
+    FdSource(int fd) : fd(fd) { posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); }
+
+    size_t read(char *buf, size_t len) override {
+        while (true) {
+            ssize_t n = ::read(fd, buf, len);
+            if (n >= 0) {
+                offset += n;
+                posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+                return n;
+            }
+            if (errno != EINTR)
+                return 0;
+        }
+    }
+};
+
+/*
+ByteRing - single-producer/single-consumer byte ring buffer. The producer blocks while it is full
+and the consumer while it is empty; close() marks the end of the data, cancel() releases a
+producer whose consumer has gone away.
+*/
+class ByteRing {
+    std::vector<char> buf;
+    size_t head = 0, size = 0; // head - next byte to pop
+    bool closed = false, cancelled = false;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+
+public:
+    ByteRing(size_t capacity) : buf(capacity) {}
+
+    // push - append [p, p + n); returns false if the ring was cancelled.
+    bool push(const char *p, size_t n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (n) {
+            not_full.wait(lock, [this] { return size < buf.size() || cancelled; });
+            if (cancelled)
+                return false;
+            size_t tail = (head + size) % buf.size();
+            size_t chunk = std::min(n, std::min(buf.size() - size, buf.size() - tail));
+            memcpy(&buf[tail], p, chunk);
+            size += chunk;
+            p += chunk;
+            n -= chunk;
+            not_empty.notify_one();
+        }
+        return true;
+    }
+
+    // pop - take up to n bytes, waiting for at least one; returns 0 once closed and drained.
+    size_t pop(char *p, size_t n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return size || closed; });
+        size_t total = 0;
+        while (total < n && size) {
+            size_t chunk = std::min(n - total, std::min(size, buf.size() - head));
+            memcpy(p + total, &buf[head], chunk);
+            head = (head + chunk) % buf.size();
+            size -= chunk;
+            total += chunk;
+        }
+        not_full.notify_one();
+        return total;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        not_full.notify_all();
+    }
+};
+
+enum class Compression { none, gzip, zstd };
+
+// compressionOf - recognise a compressed file by its magic number.
+static Compression compressionOf(int fd) {
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return Compression::gzip;
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return Compression::zstd;
+    return Compression::none;
+}
+
+/*
+DecompressSource - decompresses a file on its own thread into a ring buffer that the lexer reads
+from, so decompression overlaps with lexing and the data never takes a round trip through the disk.
+gzip files may hold several concatenated members, as produced by e.g. `cat a.gz b.gz`.
+*/
+class DecompressSource : public InputSource {
+    static constexpr size_t kRingSize = 1 << 20;
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    ByteRing ring{kRingSize};
+    std::thread worker;
+
+    // readSome - read compressed input, returns 0 at its end.
+    static ssize_t readSome(int fd, char *buf, size_t len) {
+        while (true) {
+            ssize_t n = ::read(fd, buf, len);
+            if (n >= 0 || errno != EINTR)
+                return std::max<ssize_t>(n, 0);
+        }
+    }
+
+    // inflateGzip / decompressZstd - return false on a corrupt or truncated stream.
+    bool inflateGzip([[maybe_unused]] int fd) {
+#ifdef KALEIDOSCOPE_HAVE_ZLIB
+        std::vector<char> in(kChunkSize), out(4 * kChunkSize);
+        z_stream zs = {};
+        if (inflateInit2(&zs, 15 + 16) != Z_OK)
+            return false;
+
+        bool ok = true, in_member = false, stopped = false;
+        while (ok && !stopped) {
+            ssize_t n = readSome(fd, in.data(), in.size());
+            if (!n)
+                break;
+            zs.next_in = (Bytef *)in.data();
+            zs.avail_in = n;
+            while (zs.avail_in && ok && !stopped) {
+                zs.next_out = (Bytef *)out.data();
+                zs.avail_out = out.size();
+                int ret = inflate(&zs, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    ok = false;
+                    break;
+                }
+                in_member = ret != Z_STREAM_END;
+                stopped = !ring.push(out.data(), out.size() - zs.avail_out); // the reader is gone
+                if (ret == Z_STREAM_END)
+                    inflateReset(&zs);
+            }
+        }
+        inflateEnd(&zs);
+        return ok && (stopped || !in_member);
+#else
+        fprintf(stderr, "Error: built without zlib, cannot read gzip input\n");
+        return false;
+#endif
+    }
+
+    bool decompressZstd([[maybe_unused]] int fd) {
+#ifdef KALEIDOSCOPE_HAVE_ZSTD
+        std::vector<char> in(kChunkSize), out(ZSTD_DStreamOutSize());
+        ZSTD_DStream *zs = ZSTD_createDStream();
+        ZSTD_initDStream(zs);
+
+        bool ok = true, stopped = false;
+        size_t pending = 0; // non-zero while a frame is incomplete
+        while (ok && !stopped) {
+            ssize_t n = readSome(fd, in.data(), in.size());
+            if (!n)
+                break;
+            ZSTD_inBuffer in_buf = {in.data(), (size_t)n, 0};
+            while (in_buf.pos < in_buf.size && ok && !stopped) {
+                ZSTD_outBuffer out_buf = {out.data(), out.size(), 0};
+                pending = ZSTD_decompressStream(zs, &out_buf, &in_buf);
+                if (ZSTD_isError(pending))
+                    ok = false;
+                else
+                    stopped = !ring.push(out.data(), out_buf.pos); // the reader is gone
+            }
+        }
+        ZSTD_freeDStream(zs);
+        return ok && (stopped || !pending);
+#else
+        fprintf(stderr, "Error: built without zstd, cannot read zstd input\n");
+        return false;
+#endif
+    }
+
+    void run(int fd, Compression compression) {
+        bool ok = compression == Compression::gzip ? inflateGzip(fd) : decompressZstd(fd);
+        if (!ok)
+            fprintf(stderr, "Error: compressed input is corrupt or truncated\n");
+        ::close(fd);
+        ring.close();
+    }
+
+public:
+    DecompressSource(int fd, Compression compression) : worker(&DecompressSource::run, this, fd, compression) {}
+
+    ~DecompressSource() {
+        ring.cancel();
+        worker.join();
+    }
+
+    size_t read(char *buf, size_t len) override { return ring.pop(buf, len); }
+};
+
+/*
+Recordings capture a session exactly as the lexer saw it, so a slow session can be replayed offline.
+    KALEIDOSCOPE-RECORDING 1
+    config <command line options of the recorded session, space-separated; '\', ' ' and newlines
+            inside an option are escaped as \\, \s and \n>
+    end
+followed by one record per chunk the source returned:
+    <microseconds since session start> <length>\n<length raw bytes>\n
+*/
+static const char *kRecordingMagic = "KALEIDOSCOPE-RECORDING 1";
+
+// RecordingSource - passes another source through, logging every chunk with its arrival time.
+class RecordingSource : public InputSource {
+    InputSource &inner;
+    FILE *out;
+    Clock::time_point start = Clock::now();
+
+public:
+    RecordingSource(InputSource &inner, FILE *out, const std::string &config) : inner(inner), out(out) {
+        fprintf(out, "%s\nconfig %s\nend\n", kRecordingMagic, config.c_str());
+        fflush(out);
+    }
+    ~RecordingSource() { fclose(out); }
+
+    size_t read(char *buf, size_t len) override {
+        size_t n = inner.read(buf, len);
+        if (n) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+            fprintf(out, "%lld %zu\n", (long long)us, n);
+            fwrite(buf, 1, n, out);
+            fputc('\n', out);
+            // flush per chunk: the sessions worth replaying are often the ones that get killed.
+            fflush(out);
+        }
+        return n;
+    }
+};
+
+/*
+ReplaySource - feeds a recording back chunk by chunk, streaming it rather than loading it.
+speed compresses time: 1 reproduces the original arrival times, 10 replays ten times faster,
+and 0 delivers every chunk immediately.
+*/
+class ReplaySource : public InputSource {
+    FILE *in;
+    double speed;
+    Clock::time_point start = Clock::now();
+    size_t pending = 0; // bytes of the current record not handed out yet
+
+public:
+    ReplaySource(FILE *in, double speed) : in(in), speed(speed) {}
+    ~ReplaySource() { fclose(in); }
+
+    // readHeader - check the magic and return the recorded configuration.
+    bool readHeader(std::string &config) {
+        char line[4096];
+        if (!fgets(line, sizeof(line), in) || strncmp(line, kRecordingMagic, strlen(kRecordingMagic)) != 0)
+            return false;
+        while (fgets(line, sizeof(line), in)) {
+            if (strcmp(line, "end\n") == 0) {
+                start = Clock::now();
+                return true;
+            }
+            if (strncmp(line, "config ", 7) == 0) {
+                config = line + 7;
+                if (!config.empty() && config.back() == '\n')
+                    config.pop_back();
+            }
+        }
+        return false;
+    }
+
+    size_t read(char *buf, size_t len) override {
+        if (!pending) {
+            long long us;
+            size_t n;
+            if (fscanf(in, "%lld %zu", &us, &n) != 2 || fgetc(in) != '\n')
+                return 0;
+            if (speed > 0)
+                std::this_thread::sleep_until(start + std::chrono::microseconds((long long)(us / speed)));
+            pending = n;
+        }
+        size_t n = fread(buf, 1, std::min(len, pending), in);
+        pending -= n;
+        if (!pending)
+            fgetc(in); // record terminator
+        return n;
+    }
+};
+
+/*
+Input window - the lexer scans a window of the input in place. Bytes before input_pos are consumed;
+when a token runs into the end of the window, refillWindow() moves the unconsumed part (that token)
+to the front and reads more input behind it, so nothing but the token straddling the boundary is
+ever copied. The window only grows when a single token fills it: peak memory is
+O(window + largest token) no matter how large the input is.
+*/
+static constexpr size_t kDefaultWindowSize = 64 * 1024;
+static InputSource *input = nullptr;
+static std::vector<char> window(kDefaultWindowSize);
+static size_t input_pos = 0, input_len = 0;
+static uint64_t window_offset = 0;      // input offset of window[0]
+static Clock::time_point input_arrival; // when the last read into the window returned
+
+static uint64_t inputOffset() {
+    return window_offset + input_pos;
+}
+
+/*
+findNonAscii - the first byte in [p, end) with its high bit set, or end. Whole blocks are checked at
+once: the sign bits of 64 (AVX-512BW), 32 (AVX2) or 16 (SSE2) bytes gathered into one mask. One
+binary runs on every CPU of a mixed fleet, so the wider variants are compiled for their instruction
+sets individually and selectScanKernel() picks the best one the CPU reports through cpuid at
+startup. KALEIDOSCOPE_ISA=scalar|sse2|avx2|avx512 overrides the choice, so every variant can be
+tested on one machine that has them all.
+*/
+static const char *findNonAsciiScalar(const char *p, const char *end) {
+    while (p != end && !(*p & 0x80))
+        ++p;
+    return p;
+}
+
+#if defined(__SSE2__)
+static const char *findNonAsciiSse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        if (unsigned mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)))
+            return p + __builtin_ctz(mask);
+    }
+    return findNonAsciiScalar(p, end);
+}
+#endif
+
+#if defined(__x86_64__)
+#define KALEIDOSCOPE_HAVE_ISA_DISPATCH 1
+
+__attribute__((target("avx2"))) static const char *findNonAsciiAvx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        if (unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)p)))
+            return p + __builtin_ctz(mask);
+    }
+    return findNonAsciiSse2(p, end);
+}
+
+__attribute__((target("avx512bw"))) static const char *findNonAsciiAvx512(const char *p, const char *end) {
+    for (; end - p >= 64; p += 64) {
+        if (uint64_t mask = _mm512_movepi8_mask(_mm512_loadu_si512((const void *)p)))
+            return p + __builtin_ctzll(mask);
+    }
+    return findNonAsciiAvx2(p, end);
+}
+#endif
+
+// ScanKernels - the findNonAscii variants, best last.
+static const struct {
+    const char *name;
+    const char *(*find)(const char *p, const char *end);
+    bool (*supported)();
+} ScanKernels[] = {
+    {"scalar", findNonAsciiScalar, [] { return true; }},
+#if defined(__SSE2__)
+    {"sse2", findNonAsciiSse2, [] { return true; }},
+#endif
+#ifdef KALEIDOSCOPE_HAVE_ISA_DISPATCH
+    {"avx2", findNonAsciiAvx2, [] { return (bool)__builtin_cpu_supports("avx2"); }},
+    {"avx512", findNonAsciiAvx512, [] { return (bool)__builtin_cpu_supports("avx512bw"); }},
+#endif
+};
+
+// findNonAscii - the selected variant; the compile-time baseline until selectScanKernel() runs.
+#if defined(__SSE2__)
+static const char *(*findNonAscii)(const char *p, const char *end) = findNonAsciiSse2;
+#else
+static const char *(*findNonAscii)(const char *p, const char *end) = findNonAsciiScalar;
+#endif
+static const char *scan_kernel_name = "baseline";
+
+// selectScanKernel - pick the best variant this CPU supports, or the one KALEIDOSCOPE_ISA names.
+static void selectScanKernel() {
+    const char *wanted = getenv("KALEIDOSCOPE_ISA");
+    if (wanted && !*wanted)
+        wanted = nullptr;
+    for (const auto &kernel : ScanKernels) {
+        if (!kernel.supported())
+            continue;
+        if (wanted && strcmp(wanted, kernel.name) == 0) {
+            findNonAscii = kernel.find;
+            scan_kernel_name = kernel.name;
+            fprintf(stderr, "isa: %s lexer scan, from KALEIDOSCOPE_ISA\n", kernel.name);
+            return;
+        }
+        findNonAscii = kernel.find;
+        scan_kernel_name = kernel.name;
+    }
+    if (wanted)
+        fprintf(stderr, "Error: KALEIDOSCOPE_ISA=%s is unknown or unsupported here; using %s\n", wanted, scan_kernel_name);
+}
+
+// ascii_end - window bytes in [input_pos, ascii_end) are known to be ASCII.
+static size_t ascii_end = 0;
+
+// asciiRunEnd - extend ascii_end as far as the window allows and return it; the byte there,
+// if any, is non-ASCII.
+static size_t asciiRunEnd() {
+    ascii_end = std::max(ascii_end, input_pos);
+    if (ascii_end < input_len && !(window[ascii_end] & 0x80))
+        ascii_end = findNonAscii(window.data() + ascii_end, window.data() + input_len) - window.data();
+    return ascii_end;
+}
+
+/*
+Source capture - while capture_enabled, consumed input from capture_start on is kept: the first
+kCaptureHead bytes in full plus a sliding tail of the latest bytes, so the text around any item
+can be recovered in bounded memory however long the item is.
+*/
+static constexpr size_t kCaptureHead = 256, kCaptureTail = 64;
+static bool capture_enabled = false;
+static uint64_t captured_offset = 0; // input offset up to which bytes have been captured
+static uint64_t capture_start = 0;   // input offset of capture_head[0]
+static std::string capture_head, capture_tail;
+
+static void captureBytes(const char *p, size_t n) {
+    captured_offset += n;
+    if (capture_tail.empty() && capture_head.size() < kCaptureHead) {
+        size_t to_head = std::min(n, kCaptureHead - capture_head.size());
+        capture_head.append(p, to_head);
+        p += to_head;
+        n -= to_head;
+    }
+    capture_tail.append(p + (n > kCaptureTail ? n - kCaptureTail : 0), std::min(n, kCaptureTail));
+    if (capture_tail.size() > kCaptureTail)
+        capture_tail.erase(0, capture_tail.size() - kCaptureTail);
+}
+
+// flushCapture - hand consumed window bytes the capture has not seen yet to it.
+static void flushCapture() {
+    if (!capture_enabled)
+        return;
+    captured_offset = std::max(captured_offset, window_offset);
+    size_t from = captured_offset - window_offset;
+    if (from < input_pos)
+        captureBytes(window.data() + from, input_pos - from);
+}
+
+// captureText - the captured text of [begin, end), with "..." standing in for bytes not kept.
+static std::string captureText(uint64_t begin, uint64_t end) {
+    flushCapture();
+    std::string text;
+    uint64_t head_end = capture_start + capture_head.size();
+    if (begin >= capture_start && begin < head_end)
+        text = capture_head.substr(begin - capture_start, std::min(end, head_end) - begin);
+    if (end > head_end) {
+        uint64_t tail_start = captured_offset - capture_tail.size();
+        if (std::max(begin, head_end) < tail_start)
+            text += "...";
+        if (end > tail_start)
+            text += capture_tail.substr(std::max(begin, tail_start) - tail_start, end - std::max(begin, tail_start));
+    }
+    return text;
+}
+
+// restartCapture - drop everything before begin.
+static void restartCapture(uint64_t begin) {
+    flushCapture();
+    capture_head = captureText(begin, captured_offset);
+    capture_tail.clear();
+    capture_start = begin;
+}
+
+// refillWindow - discard the window bytes before keep_from and read more input behind the rest.
+// returns false at the end of the input.
+static bool refillWindow(size_t keep_from) {
+    flushCapture();
+    if (keep_from == 0 && input_len == window.size())
+        window.resize(window.size() * 2); // one token fills the whole window
+
+    size_t keep = input_len - keep_from;
+    memmove(window.data(), window.data() + keep_from, keep);
+    window_offset += keep_from;
+    input_pos -= keep_from;
+    input_len = keep;
+    ascii_end -= std::min(ascii_end, keep_from);
+
+    size_t n = input->read(window.data() + input_len, window.size() - input_len);
+    input_arrival = Clock::now();
+    input_len += n;
+    return n != 0;
+}
 
 //-----------------------------------------------------------------------------------
 // Lexer
@@ -16,55 +581,469 @@ enum Token {
     // primary
     tok_identifier = -4,
     tok_number = -5,
+
+    // control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,
+
+    // transformations
+    tok_derive = -9,
 };
 
 static std::string identifier_str; // filled in if tok_identifier
 static double num_val;             // filled in if tok_number
+static uint64_t tok_start = 0;     // input offset of the token last returned
 
 
-// GetTok - return the next token from standard input
-static int getTok() { 
-    static int last_char = ' ';
+/*
+Lexer DFA - the scanner is a table-driven DFA generated at compile time from the spec below.
+    identifier: [a-zA-Z][a-zA-Z0-9]*
+    number:     [0-9.]+
+    keywords:   KeywordSpec, recognised inside the DFA by a trie of states branching off identifier.
+Adding a keyword means adding a Token and a KeywordSpec line; the tables are rebuilt by the compiler.
+*/
+static constexpr struct {
+    const char *spelling;
+    Token token;
+} KeywordSpec[] = {
+    {"def", tok_def},
+    {"extern", tok_extern},
+    {"if", tok_if},
+    {"then", tok_then},
+    {"else", tok_else},
+    {"derive", tok_derive},
+};
 
-    // Skip any whitespace.
-    while (isspace(last_char))
-        last_char = getchar();
-    
+// character classes, one constexpr table lookup per byte.
+enum CharClass : uint8_t {
+    cc_space = 1,
+    cc_alpha = 2,
+    cc_digit = 4,
+    cc_dot = 8,
+};
 
-    // identifier: [a-zA-Z][a-zA-Z0-9]
-    if (isalpha(last_char)) {
-        identifier_str = last_char;
-        while (isalnum((last_char = getchar())))
-            identifier_str += last_char;
-        
-        if (identifier_str == "def")
-            return tok_def;
-        if (identifier_str == "extern")
-            return tok_extern;
-        return tok_identifier;
+static constexpr uint8_t classOf(unsigned c) {
+    if (c == ' ' || (c >= '\t' && c <= '\r'))
+        return cc_space;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        return cc_alpha;
+    if (c >= '0' && c <= '9')
+        return cc_digit;
+    if (c == '.')
+        return cc_dot;
+    return 0;
+}
+
+struct CharClassTable {
+    uint8_t of[256] = {};
+
+    constexpr CharClassTable() {
+        for (unsigned c = 0; c != 256; ++c)
+            of[c] = classOf(c);
     }
+};
 
-    // number: [0-9.]+
-    if (isdigit(last_char) || last_char == '.') {
-        std::string num_str;
-        do {
-            num_str += last_char;
-            last_char = getchar();
-        } while (isdigit(last_char) || last_char == '.');
+static constexpr CharClassTable CharClasses;
 
-        // fill in num_val
-        num_val = strtod(num_str.c_str(), 0);
-        return tok_number;
+/*
+LexerDFA - next[state][byte] is the state after consuming byte, or kStop when the token ends
+before it; accept[state] is the token for a scan that stops in state (0 if none).
+Bytes 0x80-0xff always stop.
+*/
+struct LexerDFA {
+    static constexpr uint8_t kStop = 0, kStart = 1, kIdent = 2, kNumber = 3;
+    static constexpr unsigned kMaxStates = 32;
+
+    uint8_t next[kMaxStates][256] = {};
+    int8_t accept[kMaxStates] = {};
+    unsigned num_states = 4;
+
+    constexpr LexerDFA() {
+        for (unsigned c = 0; c != 256; ++c) {
+            uint8_t cls = classOf(c);
+            if (cls & cc_alpha)
+                next[kStart][c] = kIdent;
+            if (cls & (cc_digit | cc_dot))
+                next[kStart][c] = next[kNumber][c] = kNumber;
+            if (cls & (cc_alpha | cc_digit))
+                next[kIdent][c] = kIdent;
+        }
+        accept[kIdent] = tok_identifier;
+        accept[kNumber] = tok_number;
+
+        // thread each keyword through its own chain of states; every one of them behaves like
+        // kIdent except on the keyword's next letter, and only the last one accepts the keyword.
+        for (const auto &keyword : KeywordSpec) {
+            unsigned state = kStart;
+            for (const char *p = keyword.spelling; *p; ++p) {
+                unsigned c = (unsigned char)*p;
+                if (next[state][c] == kIdent) {
+                    unsigned fresh = num_states++;
+                    for (unsigned k = 0; k != 256; ++k)
+                        next[fresh][k] = next[kIdent][k];
+                    accept[fresh] = tok_identifier;
+                    next[state][c] = fresh;
+                }
+                state = next[state][c];
+            }
+            accept[state] = keyword.token;
+        }
+    }
+};
+
+static constexpr LexerDFA Dfa;
+static_assert(Dfa.num_states <= LexerDFA::kMaxStates, "too many keyword states; raise LexerDFA::kMaxStates");
+
+
+/*
+Unicode identifiers - beyond ASCII, an identifier may start with any XID_Start code point and
+continue with any XID_Continue code point, UTF-8 encoded. The tables hold the non-ASCII ranges,
+generated from the Unicode 14.0 character database; ASCII stays [a-zA-Z][a-zA-Z0-9]* as before.
+*/
+struct CodePointRange {
+    uint32_t first, last;
+};
+
+static const CodePointRange XidStart[] = {
+    {0x00AA, 0x00AA}, {0x00B5, 0x00B5}, {0x00BA, 0x00BA}, {0x00C0, 0x00D6}, {0x00D8, 0x00F6}, {0x00F8, 0x02C1},
+    {0x02C6, 0x02D1}, {0x02E0, 0x02E4}, {0x02EC, 0x02EC}, {0x02EE, 0x02EE}, {0x0370, 0x0374}, {0x0376, 0x0377},
+    {0x037B, 0x037D}, {0x037F, 0x037F}, {0x0386, 0x0386}, {0x0388, 0x038A}, {0x038C, 0x038C}, {0x038E, 0x03A1},
+    {0x03A3, 0x03F5}, {0x03F7, 0x0481}, {0x048A, 0x052F}, {0x0531, 0x0556}, {0x0559, 0x0559}, {0x0560, 0x0588},
+    {0x05D0, 0x05EA}, {0x05EF, 0x05F2}, {0x0620, 0x064A}, {0x066E, 0x066F}, {0x0671, 0x06D3}, {0x06D5, 0x06D5},
+    {0x06E5, 0x06E6}, {0x06EE, 0x06EF}, {0x06FA, 0x06FC}, {0x06FF, 0x06FF}, {0x0710, 0x0710}, {0x0712, 0x072F},
+    {0x074D, 0x07A5}, {0x07B1, 0x07B1}, {0x07CA, 0x07EA}, {0x07F4, 0x07F5}, {0x07FA, 0x07FA}, {0x0800, 0x0815},
+    {0x081A, 0x081A}, {0x0824, 0x0824}, {0x0828, 0x0828}, {0x0840, 0x0858}, {0x0860, 0x086A}, {0x0870, 0x0887},
+    {0x0889, 0x088E}, {0x08A0, 0x08C9}, {0x0904, 0x0939}, {0x093D, 0x093D}, {0x0950, 0x0950}, {0x0958, 0x0961},
+    {0x0971, 0x0980}, {0x0985, 0x098C}, {0x098F, 0x0990}, {0x0993, 0x09A8}, {0x09AA, 0x09B0}, {0x09B2, 0x09B2},
+    {0x09B6, 0x09B9}, {0x09BD, 0x09BD}, {0x09CE, 0x09CE}, {0x09DC, 0x09DD}, {0x09DF, 0x09E1}, {0x09F0, 0x09F1},
+    {0x09FC, 0x09FC}, {0x0A05, 0x0A0A}, {0x0A0F, 0x0A10}, {0x0A13, 0x0A28}, {0x0A2A, 0x0A30}, {0x0A32, 0x0A33},
+    {0x0A35, 0x0A36}, {0x0A38, 0x0A39}, {0x0A59, 0x0A5C}, {0x0A5E, 0x0A5E}, {0x0A72, 0x0A74}, {0x0A85, 0x0A8D},
+    {0x0A8F, 0x0A91}, {0x0A93, 0x0AA8}, {0x0AAA, 0x0AB0}, {0x0AB2, 0x0AB3}, {0x0AB5, 0x0AB9}, {0x0ABD, 0x0ABD},
+    {0x0AD0, 0x0AD0}, {0x0AE0, 0x0AE1}, {0x0AF9, 0x0AF9}, {0x0B05, 0x0B0C}, {0x0B0F, 0x0B10}, {0x0B13, 0x0B28},
+    {0x0B2A, 0x0B30}, {0x0B32, 0x0B33}, {0x0B35, 0x0B39}, {0x0B3D, 0x0B3D}, {0x0B5C, 0x0B5D}, {0x0B5F, 0x0B61},
+    {0x0B71, 0x0B71}, {0x0B83, 0x0B83}, {0x0B85, 0x0B8A}, {0x0B8E, 0x0B90}, {0x0B92, 0x0B95}, {0x0B99, 0x0B9A},
+    {0x0B9C, 0x0B9C}, {0x0B9E, 0x0B9F}, {0x0BA3, 0x0BA4}, {0x0BA8, 0x0BAA}, {0x0BAE, 0x0BB9}, {0x0BD0, 0x0BD0},
+    {0x0C05, 0x0C0C}, {0x0C0E, 0x0C10}, {0x0C12, 0x0C28}, {0x0C2A, 0x0C39}, {0x0C3D, 0x0C3D}, {0x0C58, 0x0C5A},
+    {0x0C5D, 0x0C5D}, {0x0C60, 0x0C61}, {0x0C80, 0x0C80}, {0x0C85, 0x0C8C}, {0x0C8E, 0x0C90}, {0x0C92, 0x0CA8},
+    {0x0CAA, 0x0CB3}, {0x0CB5, 0x0CB9}, {0x0CBD, 0x0CBD}, {0x0CDD, 0x0CDE}, {0x0CE0, 0x0CE1}, {0x0CF1, 0x0CF2},
+    {0x0D04, 0x0D0C}, {0x0D0E, 0x0D10}, {0x0D12, 0x0D3A}, {0x0D3D, 0x0D3D}, {0x0D4E, 0x0D4E}, {0x0D54, 0x0D56},
+    {0x0D5F, 0x0D61}, {0x0D7A, 0x0D7F}, {0x0D85, 0x0D96}, {0x0D9A, 0x0DB1}, {0x0DB3, 0x0DBB}, {0x0DBD, 0x0DBD},
+    {0x0DC0, 0x0DC6}, {0x0E01, 0x0E30}, {0x0E32, 0x0E32}, {0x0E40, 0x0E46}, {0x0E81, 0x0E82}, {0x0E84, 0x0E84},
+    {0x0E86, 0x0E8A}, {0x0E8C, 0x0EA3}, {0x0EA5, 0x0EA5}, {0x0EA7, 0x0EB0}, {0x0EB2, 0x0EB2}, {0x0EBD, 0x0EBD},
+    {0x0EC0, 0x0EC4}, {0x0EC6, 0x0EC6}, {0x0EDC, 0x0EDF}, {0x0F00, 0x0F00}, {0x0F40, 0x0F47}, {0x0F49, 0x0F6C},
+    {0x0F88, 0x0F8C}, {0x1000, 0x102A}, {0x103F, 0x103F}, {0x1050, 0x1055}, {0x105A, 0x105D}, {0x1061, 0x1061},
+    {0x1065, 0x1066}, {0x106E, 0x1070}, {0x1075, 0x1081}, {0x108E, 0x108E}, {0x10A0, 0x10C5}, {0x10C7, 0x10C7},
+    {0x10CD, 0x10CD}, {0x10D0, 0x10FA}, {0x10FC, 0x1248}, {0x124A, 0x124D}, {0x1250, 0x1256}, {0x1258, 0x1258},
+    {0x125A, 0x125D}, {0x1260, 0x1288}, {0x128A, 0x128D}, {0x1290, 0x12B0}, {0x12B2, 0x12B5}, {0x12B8, 0x12BE},
+    {0x12C0, 0x12C0}, {0x12C2, 0x12C5}, {0x12C8, 0x12D6}, {0x12D8, 0x1310}, {0x1312, 0x1315}, {0x1318, 0x135A},
+    {0x1380, 0x138F}, {0x13A0, 0x13F5}, {0x13F8, 0x13FD}, {0x1401, 0x166C}, {0x166F, 0x167F}, {0x1681, 0x169A},
+    {0x16A0, 0x16EA}, {0x16EE, 0x16F8}, {0x1700, 0x1711}, {0x171F, 0x1731}, {0x1740, 0x1751}, {0x1760, 0x176C},
+    {0x176E, 0x1770}, {0x1780, 0x17B3}, {0x17D7, 0x17D7}, {0x17DC, 0x17DC}, {0x1820, 0x1878}, {0x1880, 0x18A8},
+    {0x18AA, 0x18AA}, {0x18B0, 0x18F5}, {0x1900, 0x191E}, {0x1950, 0x196D}, {0x1970, 0x1974}, {0x1980, 0x19AB},
+    {0x19B0, 0x19C9}, {0x1A00, 0x1A16}, {0x1A20, 0x1A54}, {0x1AA7, 0x1AA7}, {0x1B05, 0x1B33}, {0x1B45, 0x1B4C},
+    {0x1B83, 0x1BA0}, {0x1BAE, 0x1BAF}, {0x1BBA, 0x1BE5}, {0x1C00, 0x1C23}, {0x1C4D, 0x1C4F}, {0x1C5A, 0x1C7D},
+    {0x1C80, 0x1C88}, {0x1C90, 0x1CBA}, {0x1CBD, 0x1CBF}, {0x1CE9, 0x1CEC}, {0x1CEE, 0x1CF3}, {0x1CF5, 0x1CF6},
+    {0x1CFA, 0x1CFA}, {0x1D00, 0x1DBF}, {0x1E00, 0x1F15}, {0x1F18, 0x1F1D}, {0x1F20, 0x1F45}, {0x1F48, 0x1F4D},
+    {0x1F50, 0x1F57}, {0x1F59, 0x1F59}, {0x1F5B, 0x1F5B}, {0x1F5D, 0x1F5D}, {0x1F5F, 0x1F7D}, {0x1F80, 0x1FB4},
+    {0x1FB6, 0x1FBC}, {0x1FBE, 0x1FBE}, {0x1FC2, 0x1FC4}, {0x1FC6, 0x1FCC}, {0x1FD0, 0x1FD3}, {0x1FD6, 0x1FDB},
+    {0x1FE0, 0x1FEC}, {0x1FF2, 0x1FF4}, {0x1FF6, 0x1FFC}, {0x2071, 0x2071}, {0x207F, 0x207F}, {0x2090, 0x209C},
+    {0x2102, 0x2102}, {0x2107, 0x2107}, {0x210A, 0x2113}, {0x2115, 0x2115}, {0x2118, 0x211D}, {0x2124, 0x2124},
+    {0x2126, 0x2126}, {0x2128, 0x2128}, {0x212A, 0x2139}, {0x213C, 0x213F}, {0x2145, 0x2149}, {0x214E, 0x214E},
+    {0x2160, 0x2188}, {0x2C00, 0x2CE4}, {0x2CEB, 0x2CEE}, {0x2CF2, 0x2CF3}, {0x2D00, 0x2D25}, {0x2D27, 0x2D27},
+    {0x2D2D, 0x2D2D}, {0x2D30, 0x2D67}, {0x2D6F, 0x2D6F}, {0x2D80, 0x2D96}, {0x2DA0, 0x2DA6}, {0x2DA8, 0x2DAE},
+    {0x2DB0, 0x2DB6}, {0x2DB8, 0x2DBE}, {0x2DC0, 0x2DC6}, {0x2DC8, 0x2DCE}, {0x2DD0, 0x2DD6}, {0x2DD8, 0x2DDE},
+    {0x3005, 0x3007}, {0x3021, 0x3029}, {0x3031, 0x3035}, {0x3038, 0x303C}, {0x3041, 0x3096}, {0x309D, 0x309F},
+    {0x30A1, 0x30FA}, {0x30FC, 0x30FF}, {0x3105, 0x312F}, {0x3131, 0x318E}, {0x31A0, 0x31BF}, {0x31F0, 0x31FF},
+    {0x3400, 0x4DBF}, {0x4E00, 0xA48C}, {0xA4D0, 0xA4FD}, {0xA500, 0xA60C}, {0xA610, 0xA61F}, {0xA62A, 0xA62B},
+    {0xA640, 0xA66E}, {0xA67F, 0xA69D}, {0xA6A0, 0xA6EF}, {0xA717, 0xA71F}, {0xA722, 0xA788}, {0xA78B, 0xA7CA},
+    {0xA7D0, 0xA7D1}, {0xA7D3, 0xA7D3}, {0xA7D5, 0xA7D9}, {0xA7F2, 0xA801}, {0xA803, 0xA805}, {0xA807, 0xA80A},
+    {0xA80C, 0xA822}, {0xA840, 0xA873}, {0xA882, 0xA8B3}, {0xA8F2, 0xA8F7}, {0xA8FB, 0xA8FB}, {0xA8FD, 0xA8FE},
+    {0xA90A, 0xA925}, {0xA930, 0xA946}, {0xA960, 0xA97C}, {0xA984, 0xA9B2}, {0xA9CF, 0xA9CF}, {0xA9E0, 0xA9E4},
+    {0xA9E6, 0xA9EF}, {0xA9FA, 0xA9FE}, {0xAA00, 0xAA28}, {0xAA40, 0xAA42}, {0xAA44, 0xAA4B}, {0xAA60, 0xAA76},
+    {0xAA7A, 0xAA7A}, {0xAA7E, 0xAAAF}, {0xAAB1, 0xAAB1}, {0xAAB5, 0xAAB6}, {0xAAB9, 0xAABD}, {0xAAC0, 0xAAC0},
+    {0xAAC2, 0xAAC2}, {0xAADB, 0xAADD}, {0xAAE0, 0xAAEA}, {0xAAF2, 0xAAF4}, {0xAB01, 0xAB06}, {0xAB09, 0xAB0E},
+    {0xAB11, 0xAB16}, {0xAB20, 0xAB26}, {0xAB28, 0xAB2E}, {0xAB30, 0xAB5A}, {0xAB5C, 0xAB69}, {0xAB70, 0xABE2},
+    {0xAC00, 0xD7A3}, {0xD7B0, 0xD7C6}, {0xD7CB, 0xD7FB}, {0xF900, 0xFA6D}, {0xFA70, 0xFAD9}, {0xFB00, 0xFB06},
+    {0xFB13, 0xFB17}, {0xFB1D, 0xFB1D}, {0xFB1F, 0xFB28}, {0xFB2A, 0xFB36}, {0xFB38, 0xFB3C}, {0xFB3E, 0xFB3E},
+    {0xFB40, 0xFB41}, {0xFB43, 0xFB44}, {0xFB46, 0xFBB1}, {0xFBD3, 0xFC5D}, {0xFC64, 0xFD3D}, {0xFD50, 0xFD8F},
+    {0xFD92, 0xFDC7}, {0xFDF0, 0xFDF9}, {0xFE71, 0xFE71}, {0xFE73, 0xFE73}, {0xFE77, 0xFE77}, {0xFE79, 0xFE79},
+    {0xFE7B, 0xFE7B}, {0xFE7D, 0xFE7D}, {0xFE7F, 0xFEFC}, {0xFF21, 0xFF3A}, {0xFF41, 0xFF5A}, {0xFF66, 0xFF9D},
+    {0xFFA0, 0xFFBE}, {0xFFC2, 0xFFC7}, {0xFFCA, 0xFFCF}, {0xFFD2, 0xFFD7}, {0xFFDA, 0xFFDC}, {0x10000, 0x1000B},
+    {0x1000D, 0x10026}, {0x10028, 0x1003A}, {0x1003C, 0x1003D}, {0x1003F, 0x1004D}, {0x10050, 0x1005D}, {0x10080, 0x100FA},
+    {0x10140, 0x10174}, {0x10280, 0x1029C}, {0x102A0, 0x102D0}, {0x10300, 0x1031F}, {0x1032D, 0x1034A}, {0x10350, 0x10375},
+    {0x10380, 0x1039D}, {0x103A0, 0x103C3}, {0x103C8, 0x103CF}, {0x103D1, 0x103D5}, {0x10400, 0x1049D}, {0x104B0, 0x104D3},
+    {0x104D8, 0x104FB}, {0x10500, 0x10527}, {0x10530, 0x10563}, {0x10570, 0x1057A}, {0x1057C, 0x1058A}, {0x1058C, 0x10592},
+    {0x10594, 0x10595}, {0x10597, 0x105A1}, {0x105A3, 0x105B1}, {0x105B3, 0x105B9}, {0x105BB, 0x105BC}, {0x10600, 0x10736},
+    {0x10740, 0x10755}, {0x10760, 0x10767}, {0x10780, 0x10785}, {0x10787, 0x107B0}, {0x107B2, 0x107BA}, {0x10800, 0x10805},
+    {0x10808, 0x10808}, {0x1080A, 0x10835}, {0x10837, 0x10838}, {0x1083C, 0x1083C}, {0x1083F, 0x10855}, {0x10860, 0x10876},
+    {0x10880, 0x1089E}, {0x108E0, 0x108F2}, {0x108F4, 0x108F5}, {0x10900, 0x10915}, {0x10920, 0x10939}, {0x10980, 0x109B7},
+    {0x109BE, 0x109BF}, {0x10A00, 0x10A00}, {0x10A10, 0x10A13}, {0x10A15, 0x10A17}, {0x10A19, 0x10A35}, {0x10A60, 0x10A7C},
+    {0x10A80, 0x10A9C}, {0x10AC0, 0x10AC7}, {0x10AC9, 0x10AE4}, {0x10B00, 0x10B35}, {0x10B40, 0x10B55}, {0x10B60, 0x10B72},
+    {0x10B80, 0x10B91}, {0x10C00, 0x10C48}, {0x10C80, 0x10CB2}, {0x10CC0, 0x10CF2}, {0x10D00, 0x10D23}, {0x10E80, 0x10EA9},
+    {0x10EB0, 0x10EB1}, {0x10F00, 0x10F1C}, {0x10F27, 0x10F27}, {0x10F30, 0x10F45}, {0x10F70, 0x10F81}, {0x10FB0, 0x10FC4},
+    {0x10FE0, 0x10FF6}, {0x11003, 0x11037}, {0x11071, 0x11072}, {0x11075, 0x11075}, {0x11083, 0x110AF}, {0x110D0, 0x110E8},
+    {0x11103, 0x11126}, {0x11144, 0x11144}, {0x11147, 0x11147}, {0x11150, 0x11172}, {0x11176, 0x11176}, {0x11183, 0x111B2},
+    {0x111C1, 0x111C4}, {0x111DA, 0x111DA}, {0x111DC, 0x111DC}, {0x11200, 0x11211}, {0x11213, 0x1122B}, {0x11280, 0x11286},
+    {0x11288, 0x11288}, {0x1128A, 0x1128D}, {0x1128F, 0x1129D}, {0x1129F, 0x112A8}, {0x112B0, 0x112DE}, {0x11305, 0x1130C},
+    {0x1130F, 0x11310}, {0x11313, 0x11328}, {0x1132A, 0x11330}, {0x11332, 0x11333}, {0x11335, 0x11339}, {0x1133D, 0x1133D},
+    {0x11350, 0x11350}, {0x1135D, 0x11361}, {0x11400, 0x11434}, {0x11447, 0x1144A}, {0x1145F, 0x11461}, {0x11480, 0x114AF},
+    {0x114C4, 0x114C5}, {0x114C7, 0x114C7}, {0x11580, 0x115AE}, {0x115D8, 0x115DB}, {0x11600, 0x1162F}, {0x11644, 0x11644},
+    {0x11680, 0x116AA}, {0x116B8, 0x116B8}, {0x11700, 0x1171A}, {0x11740, 0x11746}, {0x11800, 0x1182B}, {0x118A0, 0x118DF},
+    {0x118FF, 0x11906}, {0x11909, 0x11909}, {0x1190C, 0x11913}, {0x11915, 0x11916}, {0x11918, 0x1192F}, {0x1193F, 0x1193F},
+    {0x11941, 0x11941}, {0x119A0, 0x119A7}, {0x119AA, 0x119D0}, {0x119E1, 0x119E1}, {0x119E3, 0x119E3}, {0x11A00, 0x11A00},
+    {0x11A0B, 0x11A32}, {0x11A3A, 0x11A3A}, {0x11A50, 0x11A50}, {0x11A5C, 0x11A89}, {0x11A9D, 0x11A9D}, {0x11AB0, 0x11AF8},
+    {0x11C00, 0x11C08}, {0x11C0A, 0x11C2E}, {0x11C40, 0x11C40}, {0x11C72, 0x11C8F}, {0x11D00, 0x11D06}, {0x11D08, 0x11D09},
+    {0x11D0B, 0x11D30}, {0x11D46, 0x11D46}, {0x11D60, 0x11D65}, {0x11D67, 0x11D68}, {0x11D6A, 0x11D89}, {0x11D98, 0x11D98},
+    {0x11EE0, 0x11EF2}, {0x11FB0, 0x11FB0}, {0x12000, 0x12399}, {0x12400, 0x1246E}, {0x12480, 0x12543}, {0x12F90, 0x12FF0},
+    {0x13000, 0x1342E}, {0x14400, 0x14646}, {0x16800, 0x16A38}, {0x16A40, 0x16A5E}, {0x16A70, 0x16ABE}, {0x16AD0, 0x16AED},
+    {0x16B00, 0x16B2F}, {0x16B40, 0x16B43}, {0x16B63, 0x16B77}, {0x16B7D, 0x16B8F}, {0x16E40, 0x16E7F}, {0x16F00, 0x16F4A},
+    {0x16F50, 0x16F50}, {0x16F93, 0x16F9F}, {0x16FE0, 0x16FE1}, {0x16FE3, 0x16FE3}, {0x17000, 0x187F7}, {0x18800, 0x18CD5},
+    {0x18D00, 0x18D08}, {0x1AFF0, 0x1AFF3}, {0x1AFF5, 0x1AFFB}, {0x1AFFD, 0x1AFFE}, {0x1B000, 0x1B122}, {0x1B150, 0x1B152},
+    {0x1B164, 0x1B167}, {0x1B170, 0x1B2FB}, {0x1BC00, 0x1BC6A}, {0x1BC70, 0x1BC7C}, {0x1BC80, 0x1BC88}, {0x1BC90, 0x1BC99},
+    {0x1D400, 0x1D454}, {0x1D456, 0x1D49C}, {0x1D49E, 0x1D49F}, {0x1D4A2, 0x1D4A2}, {0x1D4A5, 0x1D4A6}, {0x1D4A9, 0x1D4AC},
+    {0x1D4AE, 0x1D4B9}, {0x1D4BB, 0x1D4BB}, {0x1D4BD, 0x1D4C3}, {0x1D4C5, 0x1D505}, {0x1D507, 0x1D50A}, {0x1D50D, 0x1D514},
+    {0x1D516, 0x1D51C}, {0x1D51E, 0x1D539}, {0x1D53B, 0x1D53E}, {0x1D540, 0x1D544}, {0x1D546, 0x1D546}, {0x1D54A, 0x1D550},
+    {0x1D552, 0x1D6A5}, {0x1D6A8, 0x1D6C0}, {0x1D6C2, 0x1D6DA}, {0x1D6DC, 0x1D6FA}, {0x1D6FC, 0x1D714}, {0x1D716, 0x1D734},
+    {0x1D736, 0x1D74E}, {0x1D750, 0x1D76E}, {0x1D770, 0x1D788}, {0x1D78A, 0x1D7A8}, {0x1D7AA, 0x1D7C2}, {0x1D7C4, 0x1D7CB},
+    {0x1DF00, 0x1DF1E}, {0x1E100, 0x1E12C}, {0x1E137, 0x1E13D}, {0x1E14E, 0x1E14E}, {0x1E290, 0x1E2AD}, {0x1E2C0, 0x1E2EB},
+    {0x1E7E0, 0x1E7E6}, {0x1E7E8, 0x1E7EB}, {0x1E7ED, 0x1E7EE}, {0x1E7F0, 0x1E7FE}, {0x1E800, 0x1E8C4}, {0x1E900, 0x1E943},
+    {0x1E94B, 0x1E94B}, {0x1EE00, 0x1EE03}, {0x1EE05, 0x1EE1F}, {0x1EE21, 0x1EE22}, {0x1EE24, 0x1EE24}, {0x1EE27, 0x1EE27},
+    {0x1EE29, 0x1EE32}, {0x1EE34, 0x1EE37}, {0x1EE39, 0x1EE39}, {0x1EE3B, 0x1EE3B}, {0x1EE42, 0x1EE42}, {0x1EE47, 0x1EE47},
+    {0x1EE49, 0x1EE49}, {0x1EE4B, 0x1EE4B}, {0x1EE4D, 0x1EE4F}, {0x1EE51, 0x1EE52}, {0x1EE54, 0x1EE54}, {0x1EE57, 0x1EE57},
+    {0x1EE59, 0x1EE59}, {0x1EE5B, 0x1EE5B}, {0x1EE5D, 0x1EE5D}, {0x1EE5F, 0x1EE5F}, {0x1EE61, 0x1EE62}, {0x1EE64, 0x1EE64},
+    {0x1EE67, 0x1EE6A}, {0x1EE6C, 0x1EE72}, {0x1EE74, 0x1EE77}, {0x1EE79, 0x1EE7C}, {0x1EE7E, 0x1EE7E}, {0x1EE80, 0x1EE89},
+    {0x1EE8B, 0x1EE9B}, {0x1EEA1, 0x1EEA3}, {0x1EEA5, 0x1EEA9}, {0x1EEAB, 0x1EEBB}, {0x20000, 0x2A6DF}, {0x2A700, 0x2B738},
+    {0x2B740, 0x2B81D}, {0x2B820, 0x2CEA1}, {0x2CEB0, 0x2EBE0}, {0x2F800, 0x2FA1D}, {0x30000, 0x3134A},
+};
+
+static const CodePointRange XidContinue[] = {
+    {0x00AA, 0x00AA}, {0x00B5, 0x00B5}, {0x00B7, 0x00B7}, {0x00BA, 0x00BA}, {0x00C0, 0x00D6}, {0x00D8, 0x00F6},
+    {0x00F8, 0x02C1}, {0x02C6, 0x02D1}, {0x02E0, 0x02E4}, {0x02EC, 0x02EC}, {0x02EE, 0x02EE}, {0x0300, 0x0374},
+    {0x0376, 0x0377}, {0x037B, 0x037D}, {0x037F, 0x037F}, {0x0386, 0x038A}, {0x038C, 0x038C}, {0x038E, 0x03A1},
+    {0x03A3, 0x03F5}, {0x03F7, 0x0481}, {0x0483, 0x0487}, {0x048A, 0x052F}, {0x0531, 0x0556}, {0x0559, 0x0559},
+    {0x0560, 0x0588}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7},
+    {0x05D0, 0x05EA}, {0x05EF, 0x05F2}, {0x0610, 0x061A}, {0x0620, 0x0669}, {0x066E, 0x06D3}, {0x06D5, 0x06DC},
+    {0x06DF, 0x06E8}, {0x06EA, 0x06FC}, {0x06FF, 0x06FF}, {0x0710, 0x074A}, {0x074D, 0x07B1}, {0x07C0, 0x07F5},
+    {0x07FA, 0x07FA}, {0x07FD, 0x07FD}, {0x0800, 0x082D}, {0x0840, 0x085B}, {0x0860, 0x086A}, {0x0870, 0x0887},
+    {0x0889, 0x088E}, {0x0898, 0x08E1}, {0x08E3, 0x0963}, {0x0966, 0x096F}, {0x0971, 0x0983}, {0x0985, 0x098C},
+    {0x098F, 0x0990}, {0x0993, 0x09A8}, {0x09AA, 0x09B0}, {0x09B2, 0x09B2}, {0x09B6, 0x09B9}, {0x09BC, 0x09C4},
+    {0x09C7, 0x09C8}, {0x09CB, 0x09CE}, {0x09D7, 0x09D7}, {0x09DC, 0x09DD}, {0x09DF, 0x09E3}, {0x09E6, 0x09F1},
+    {0x09FC, 0x09FC}, {0x09FE, 0x09FE}, {0x0A01, 0x0A03}, {0x0A05, 0x0A0A}, {0x0A0F, 0x0A10}, {0x0A13, 0x0A28},
+    {0x0A2A, 0x0A30}, {0x0A32, 0x0A33}, {0x0A35, 0x0A36}, {0x0A38, 0x0A39}, {0x0A3C, 0x0A3C}, {0x0A3E, 0x0A42},
+    {0x0A47, 0x0A48}, {0x0A4B, 0x0A4D}, {0x0A51, 0x0A51}, {0x0A59, 0x0A5C}, {0x0A5E, 0x0A5E}, {0x0A66, 0x0A75},
+    {0x0A81, 0x0A83}, {0x0A85, 0x0A8D}, {0x0A8F, 0x0A91}, {0x0A93, 0x0AA8}, {0x0AAA, 0x0AB0}, {0x0AB2, 0x0AB3},
+    {0x0AB5, 0x0AB9}, {0x0ABC, 0x0AC5}, {0x0AC7, 0x0AC9}, {0x0ACB, 0x0ACD}, {0x0AD0, 0x0AD0}, {0x0AE0, 0x0AE3},
+    {0x0AE6, 0x0AEF}, {0x0AF9, 0x0AFF}, {0x0B01, 0x0B03}, {0x0B05, 0x0B0C}, {0x0B0F, 0x0B10}, {0x0B13, 0x0B28},
+    {0x0B2A, 0x0B30}, {0x0B32, 0x0B33}, {0x0B35, 0x0B39}, {0x0B3C, 0x0B44}, {0x0B47, 0x0B48}, {0x0B4B, 0x0B4D},
+    {0x0B55, 0x0B57}, {0x0B5C, 0x0B5D}, {0x0B5F, 0x0B63}, {0x0B66, 0x0B6F}, {0x0B71, 0x0B71}, {0x0B82, 0x0B83},
+    {0x0B85, 0x0B8A}, {0x0B8E, 0x0B90}, {0x0B92, 0x0B95}, {0x0B99, 0x0B9A}, {0x0B9C, 0x0B9C}, {0x0B9E, 0x0B9F},
+    {0x0BA3, 0x0BA4}, {0x0BA8, 0x0BAA}, {0x0BAE, 0x0BB9}, {0x0BBE, 0x0BC2}, {0x0BC6, 0x0BC8}, {0x0BCA, 0x0BCD},
+    {0x0BD0, 0x0BD0}, {0x0BD7, 0x0BD7}, {0x0BE6, 0x0BEF}, {0x0C00, 0x0C0C}, {0x0C0E, 0x0C10}, {0x0C12, 0x0C28},
+    {0x0C2A, 0x0C39}, {0x0C3C, 0x0C44}, {0x0C46, 0x0C48}, {0x0C4A, 0x0C4D}, {0x0C55, 0x0C56}, {0x0C58, 0x0C5A},
+    {0x0C5D, 0x0C5D}, {0x0C60, 0x0C63}, {0x0C66, 0x0C6F}, {0x0C80, 0x0C83}, {0x0C85, 0x0C8C}, {0x0C8E, 0x0C90},
+    {0x0C92, 0x0CA8}, {0x0CAA, 0x0CB3}, {0x0CB5, 0x0CB9}, {0x0CBC, 0x0CC4}, {0x0CC6, 0x0CC8}, {0x0CCA, 0x0CCD},
+    {0x0CD5, 0x0CD6}, {0x0CDD, 0x0CDE}, {0x0CE0, 0x0CE3}, {0x0CE6, 0x0CEF}, {0x0CF1, 0x0CF2}, {0x0D00, 0x0D0C},
+    {0x0D0E, 0x0D10}, {0x0D12, 0x0D44}, {0x0D46, 0x0D48}, {0x0D4A, 0x0D4E}, {0x0D54, 0x0D57}, {0x0D5F, 0x0D63},
+    {0x0D66, 0x0D6F}, {0x0D7A, 0x0D7F}, {0x0D81, 0x0D83}, {0x0D85, 0x0D96}, {0x0D9A, 0x0DB1}, {0x0DB3, 0x0DBB},
+    {0x0DBD, 0x0DBD}, {0x0DC0, 0x0DC6}, {0x0DCA, 0x0DCA}, {0x0DCF, 0x0DD4}, {0x0DD6, 0x0DD6}, {0x0DD8, 0x0DDF},
+    {0x0DE6, 0x0DEF}, {0x0DF2, 0x0DF3}, {0x0E01, 0x0E3A}, {0x0E40, 0x0E4E}, {0x0E50, 0x0E59}, {0x0E81, 0x0E82},
+    {0x0E84, 0x0E84}, {0x0E86, 0x0E8A}, {0x0E8C, 0x0EA3}, {0x0EA5, 0x0EA5}, {0x0EA7, 0x0EBD}, {0x0EC0, 0x0EC4},
+    {0x0EC6, 0x0EC6}, {0x0EC8, 0x0ECD}, {0x0ED0, 0x0ED9}, {0x0EDC, 0x0EDF}, {0x0F00, 0x0F00}, {0x0F18, 0x0F19},
+    {0x0F20, 0x0F29}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F3E, 0x0F47}, {0x0F49, 0x0F6C},
+    {0x0F71, 0x0F84}, {0x0F86, 0x0F97}, {0x0F99, 0x0FBC}, {0x0FC6, 0x0FC6}, {0x1000, 0x1049}, {0x1050, 0x109D},
+    {0x10A0, 0x10C5}, {0x10C7, 0x10C7}, {0x10CD, 0x10CD}, {0x10D0, 0x10FA}, {0x10FC, 0x1248}, {0x124A, 0x124D},
+    {0x1250, 0x1256}, {0x1258, 0x1258}, {0x125A, 0x125D}, {0x1260, 0x1288}, {0x128A, 0x128D}, {0x1290, 0x12B0},
+    {0x12B2, 0x12B5}, {0x12B8, 0x12BE}, {0x12C0, 0x12C0}, {0x12C2, 0x12C5}, {0x12C8, 0x12D6}, {0x12D8, 0x1310},
+    {0x1312, 0x1315}, {0x1318, 0x135A}, {0x135D, 0x135F}, {0x1369, 0x1371}, {0x1380, 0x138F}, {0x13A0, 0x13F5},
+    {0x13F8, 0x13FD}, {0x1401, 0x166C}, {0x166F, 0x167F}, {0x1681, 0x169A}, {0x16A0, 0x16EA}, {0x16EE, 0x16F8},
+    {0x1700, 0x1715}, {0x171F, 0x1734}, {0x1740, 0x1753}, {0x1760, 0x176C}, {0x176E, 0x1770}, {0x1772, 0x1773},
+    {0x1780, 0x17D3}, {0x17D7, 0x17D7}, {0x17DC, 0x17DD}, {0x17E0, 0x17E9}, {0x180B, 0x180D}, {0x180F, 0x1819},
+    {0x1820, 0x1878}, {0x1880, 0x18AA}, {0x18B0, 0x18F5}, {0x1900, 0x191E}, {0x1920, 0x192B}, {0x1930, 0x193B},
+    {0x1946, 0x196D}, {0x1970, 0x1974}, {0x1980, 0x19AB}, {0x19B0, 0x19C9}, {0x19D0, 0x19DA}, {0x1A00, 0x1A1B},
+    {0x1A20, 0x1A5E}, {0x1A60, 0x1A7C}, {0x1A7F, 0x1A89}, {0x1A90, 0x1A99}, {0x1AA7, 0x1AA7}, {0x1AB0, 0x1ABD},
+    {0x1ABF, 0x1ACE}, {0x1B00, 0x1B4C}, {0x1B50, 0x1B59}, {0x1B6B, 0x1B73}, {0x1B80, 0x1BF3}, {0x1C00, 0x1C37},
+    {0x1C40, 0x1C49}, {0x1C4D, 0x1C7D}, {0x1C80, 0x1C88}, {0x1C90, 0x1CBA}, {0x1CBD, 0x1CBF}, {0x1CD0, 0x1CD2},
+    {0x1CD4, 0x1CFA}, {0x1D00, 0x1F15}, {0x1F18, 0x1F1D}, {0x1F20, 0x1F45}, {0x1F48, 0x1F4D}, {0x1F50, 0x1F57},
+    {0x1F59, 0x1F59}, {0x1F5B, 0x1F5B}, {0x1F5D, 0x1F5D}, {0x1F5F, 0x1F7D}, {0x1F80, 0x1FB4}, {0x1FB6, 0x1FBC},
+    {0x1FBE, 0x1FBE}, {0x1FC2, 0x1FC4}, {0x1FC6, 0x1FCC}, {0x1FD0, 0x1FD3}, {0x1FD6, 0x1FDB}, {0x1FE0, 0x1FEC},
+    {0x1FF2, 0x1FF4}, {0x1FF6, 0x1FFC}, {0x203F, 0x2040}, {0x2054, 0x2054}, {0x2071, 0x2071}, {0x207F, 0x207F},
+    {0x2090, 0x209C}, {0x20D0, 0x20DC}, {0x20E1, 0x20E1}, {0x20E5, 0x20F0}, {0x2102, 0x2102}, {0x2107, 0x2107},
+    {0x210A, 0x2113}, {0x2115, 0x2115}, {0x2118, 0x211D}, {0x2124, 0x2124}, {0x2126, 0x2126}, {0x2128, 0x2128},
+    {0x212A, 0x2139}, {0x213C, 0x213F}, {0x2145, 0x2149}, {0x214E, 0x214E}, {0x2160, 0x2188}, {0x2C00, 0x2CE4},
+    {0x2CEB, 0x2CF3}, {0x2D00, 0x2D25}, {0x2D27, 0x2D27}, {0x2D2D, 0x2D2D}, {0x2D30, 0x2D67}, {0x2D6F, 0x2D6F},
+    {0x2D7F, 0x2D96}, {0x2DA0, 0x2DA6}, {0x2DA8, 0x2DAE}, {0x2DB0, 0x2DB6}, {0x2DB8, 0x2DBE}, {0x2DC0, 0x2DC6},
+    {0x2DC8, 0x2DCE}, {0x2DD0, 0x2DD6}, {0x2DD8, 0x2DDE}, {0x2DE0, 0x2DFF}, {0x3005, 0x3007}, {0x3021, 0x302F},
+    {0x3031, 0x3035}, {0x3038, 0x303C}, {0x3041, 0x3096}, {0x3099, 0x309A}, {0x309D, 0x309F}, {0x30A1, 0x30FA},
+    {0x30FC, 0x30FF}, {0x3105, 0x312F}, {0x3131, 0x318E}, {0x31A0, 0x31BF}, {0x31F0, 0x31FF}, {0x3400, 0x4DBF},
+    {0x4E00, 0xA48C}, {0xA4D0, 0xA4FD}, {0xA500, 0xA60C}, {0xA610, 0xA62B}, {0xA640, 0xA66F}, {0xA674, 0xA67D},
+    {0xA67F, 0xA6F1}, {0xA717, 0xA71F}, {0xA722, 0xA788}, {0xA78B, 0xA7CA}, {0xA7D0, 0xA7D1}, {0xA7D3, 0xA7D3},
+    {0xA7D5, 0xA7D9}, {0xA7F2, 0xA827}, {0xA82C, 0xA82C}, {0xA840, 0xA873}, {0xA880, 0xA8C5}, {0xA8D0, 0xA8D9},
+    {0xA8E0, 0xA8F7}, {0xA8FB, 0xA8FB}, {0xA8FD, 0xA92D}, {0xA930, 0xA953}, {0xA960, 0xA97C}, {0xA980, 0xA9C0},
+    {0xA9CF, 0xA9D9}, {0xA9E0, 0xA9FE}, {0xAA00, 0xAA36}, {0xAA40, 0xAA4D}, {0xAA50, 0xAA59}, {0xAA60, 0xAA76},
+    {0xAA7A, 0xAAC2}, {0xAADB, 0xAADD}, {0xAAE0, 0xAAEF}, {0xAAF2, 0xAAF6}, {0xAB01, 0xAB06}, {0xAB09, 0xAB0E},
+    {0xAB11, 0xAB16}, {0xAB20, 0xAB26}, {0xAB28, 0xAB2E}, {0xAB30, 0xAB5A}, {0xAB5C, 0xAB69}, {0xAB70, 0xABEA},
+    {0xABEC, 0xABED}, {0xABF0, 0xABF9}, {0xAC00, 0xD7A3}, {0xD7B0, 0xD7C6}, {0xD7CB, 0xD7FB}, {0xF900, 0xFA6D},
+    {0xFA70, 0xFAD9}, {0xFB00, 0xFB06}, {0xFB13, 0xFB17}, {0xFB1D, 0xFB28}, {0xFB2A, 0xFB36}, {0xFB38, 0xFB3C},
+    {0xFB3E, 0xFB3E}, {0xFB40, 0xFB41}, {0xFB43, 0xFB44}, {0xFB46, 0xFBB1}, {0xFBD3, 0xFC5D}, {0xFC64, 0xFD3D},
+    {0xFD50, 0xFD8F}, {0xFD92, 0xFDC7}, {0xFDF0, 0xFDF9}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFE33, 0xFE34},
+    {0xFE4D, 0xFE4F}, {0xFE71, 0xFE71}, {0xFE73, 0xFE73}, {0xFE77, 0xFE77}, {0xFE79, 0xFE79}, {0xFE7B, 0xFE7B},
+    {0xFE7D, 0xFE7D}, {0xFE7F, 0xFEFC}, {0xFF10, 0xFF19}, {0xFF21, 0xFF3A}, {0xFF3F, 0xFF3F}, {0xFF41, 0xFF5A},
+    {0xFF66, 0xFFBE}, {0xFFC2, 0xFFC7}, {0xFFCA, 0xFFCF}, {0xFFD2, 0xFFD7}, {0xFFDA, 0xFFDC}, {0x10000, 0x1000B},
+    {0x1000D, 0x10026}, {0x10028, 0x1003A}, {0x1003C, 0x1003D}, {0x1003F, 0x1004D}, {0x10050, 0x1005D}, {0x10080, 0x100FA},
+    {0x10140, 0x10174}, {0x101FD, 0x101FD}, {0x10280, 0x1029C}, {0x102A0, 0x102D0}, {0x102E0, 0x102E0}, {0x10300, 0x1031F},
+    {0x1032D, 0x1034A}, {0x10350, 0x1037A}, {0x10380, 0x1039D}, {0x103A0, 0x103C3}, {0x103C8, 0x103CF}, {0x103D1, 0x103D5},
+    {0x10400, 0x1049D}, {0x104A0, 0x104A9}, {0x104B0, 0x104D3}, {0x104D8, 0x104FB}, {0x10500, 0x10527}, {0x10530, 0x10563},
+    {0x10570, 0x1057A}, {0x1057C, 0x1058A}, {0x1058C, 0x10592}, {0x10594, 0x10595}, {0x10597, 0x105A1}, {0x105A3, 0x105B1},
+    {0x105B3, 0x105B9}, {0x105BB, 0x105BC}, {0x10600, 0x10736}, {0x10740, 0x10755}, {0x10760, 0x10767}, {0x10780, 0x10785},
+    {0x10787, 0x107B0}, {0x107B2, 0x107BA}, {0x10800, 0x10805}, {0x10808, 0x10808}, {0x1080A, 0x10835}, {0x10837, 0x10838},
+    {0x1083C, 0x1083C}, {0x1083F, 0x10855}, {0x10860, 0x10876}, {0x10880, 0x1089E}, {0x108E0, 0x108F2}, {0x108F4, 0x108F5},
+    {0x10900, 0x10915}, {0x10920, 0x10939}, {0x10980, 0x109B7}, {0x109BE, 0x109BF}, {0x10A00, 0x10A03}, {0x10A05, 0x10A06},
+    {0x10A0C, 0x10A13}, {0x10A15, 0x10A17}, {0x10A19, 0x10A35}, {0x10A38, 0x10A3A}, {0x10A3F, 0x10A3F}, {0x10A60, 0x10A7C},
+    {0x10A80, 0x10A9C}, {0x10AC0, 0x10AC7}, {0x10AC9, 0x10AE6}, {0x10B00, 0x10B35}, {0x10B40, 0x10B55}, {0x10B60, 0x10B72},
+    {0x10B80, 0x10B91}, {0x10C00, 0x10C48}, {0x10C80, 0x10CB2}, {0x10CC0, 0x10CF2}, {0x10D00, 0x10D27}, {0x10D30, 0x10D39},
+    {0x10E80, 0x10EA9}, {0x10EAB, 0x10EAC}, {0x10EB0, 0x10EB1}, {0x10F00, 0x10F1C}, {0x10F27, 0x10F27}, {0x10F30, 0x10F50},
+    {0x10F70, 0x10F85}, {0x10FB0, 0x10FC4}, {0x10FE0, 0x10FF6}, {0x11000, 0x11046}, {0x11066, 0x11075}, {0x1107F, 0x110BA},
+    {0x110C2, 0x110C2}, {0x110D0, 0x110E8}, {0x110F0, 0x110F9}, {0x11100, 0x11134}, {0x11136, 0x1113F}, {0x11144, 0x11147},
+    {0x11150, 0x11173}, {0x11176, 0x11176}, {0x11180, 0x111C4}, {0x111C9, 0x111CC}, {0x111CE, 0x111DA}, {0x111DC, 0x111DC},
+    {0x11200, 0x11211}, {0x11213, 0x11237}, {0x1123E, 0x1123E}, {0x11280, 0x11286}, {0x11288, 0x11288}, {0x1128A, 0x1128D},
+    {0x1128F, 0x1129D}, {0x1129F, 0x112A8}, {0x112B0, 0x112EA}, {0x112F0, 0x112F9}, {0x11300, 0x11303}, {0x11305, 0x1130C},
+    {0x1130F, 0x11310}, {0x11313, 0x11328}, {0x1132A, 0x11330}, {0x11332, 0x11333}, {0x11335, 0x11339}, {0x1133B, 0x11344},
+    {0x11347, 0x11348}, {0x1134B, 0x1134D}, {0x11350, 0x11350}, {0x11357, 0x11357}, {0x1135D, 0x11363}, {0x11366, 0x1136C},
+    {0x11370, 0x11374}, {0x11400, 0x1144A}, {0x11450, 0x11459}, {0x1145E, 0x11461}, {0x11480, 0x114C5}, {0x114C7, 0x114C7},
+    {0x114D0, 0x114D9}, {0x11580, 0x115B5}, {0x115B8, 0x115C0}, {0x115D8, 0x115DD}, {0x11600, 0x11640}, {0x11644, 0x11644},
+    {0x11650, 0x11659}, {0x11680, 0x116B8}, {0x116C0, 0x116C9}, {0x11700, 0x1171A}, {0x1171D, 0x1172B}, {0x11730, 0x11739},
+    {0x11740, 0x11746}, {0x11800, 0x1183A}, {0x118A0, 0x118E9}, {0x118FF, 0x11906}, {0x11909, 0x11909}, {0x1190C, 0x11913},
+    {0x11915, 0x11916}, {0x11918, 0x11935}, {0x11937, 0x11938}, {0x1193B, 0x11943}, {0x11950, 0x11959}, {0x119A0, 0x119A7},
+    {0x119AA, 0x119D7}, {0x119DA, 0x119E1}, {0x119E3, 0x119E4}, {0x11A00, 0x11A3E}, {0x11A47, 0x11A47}, {0x11A50, 0x11A99},
+    {0x11A9D, 0x11A9D}, {0x11AB0, 0x11AF8}, {0x11C00, 0x11C08}, {0x11C0A, 0x11C36}, {0x11C38, 0x11C40}, {0x11C50, 0x11C59},
+    {0x11C72, 0x11C8F}, {0x11C92, 0x11CA7}, {0x11CA9, 0x11CB6}, {0x11D00, 0x11D06}, {0x11D08, 0x11D09}, {0x11D0B, 0x11D36},
+    {0x11D3A, 0x11D3A}, {0x11D3C, 0x11D3D}, {0x11D3F, 0x11D47}, {0x11D50, 0x11D59}, {0x11D60, 0x11D65}, {0x11D67, 0x11D68},
+    {0x11D6A, 0x11D8E}, {0x11D90, 0x11D91}, {0x11D93, 0x11D98}, {0x11DA0, 0x11DA9}, {0x11EE0, 0x11EF6}, {0x11FB0, 0x11FB0},
+    {0x12000, 0x12399}, {0x12400, 0x1246E}, {0x12480, 0x12543}, {0x12F90, 0x12FF0}, {0x13000, 0x1342E}, {0x14400, 0x14646},
+    {0x16800, 0x16A38}, {0x16A40, 0x16A5E}, {0x16A60, 0x16A69}, {0x16A70, 0x16ABE}, {0x16AC0, 0x16AC9}, {0x16AD0, 0x16AED},
+    {0x16AF0, 0x16AF4}, {0x16B00, 0x16B36}, {0x16B40, 0x16B43}, {0x16B50, 0x16B59}, {0x16B63, 0x16B77}, {0x16B7D, 0x16B8F},
+    {0x16E40, 0x16E7F}, {0x16F00, 0x16F4A}, {0x16F4F, 0x16F87}, {0x16F8F, 0x16F9F}, {0x16FE0, 0x16FE1}, {0x16FE3, 0x16FE4},
+    {0x16FF0, 0x16FF1}, {0x17000, 0x187F7}, {0x18800, 0x18CD5}, {0x18D00, 0x18D08}, {0x1AFF0, 0x1AFF3}, {0x1AFF5, 0x1AFFB},
+    {0x1AFFD, 0x1AFFE}, {0x1B000, 0x1B122}, {0x1B150, 0x1B152}, {0x1B164, 0x1B167}, {0x1B170, 0x1B2FB}, {0x1BC00, 0x1BC6A},
+    {0x1BC70, 0x1BC7C}, {0x1BC80, 0x1BC88}, {0x1BC90, 0x1BC99}, {0x1BC9D, 0x1BC9E}, {0x1CF00, 0x1CF2D}, {0x1CF30, 0x1CF46},
+    {0x1D165, 0x1D169}, {0x1D16D, 0x1D172}, {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244},
+    {0x1D400, 0x1D454}, {0x1D456, 0x1D49C}, {0x1D49E, 0x1D49F}, {0x1D4A2, 0x1D4A2}, {0x1D4A5, 0x1D4A6}, {0x1D4A9, 0x1D4AC},
+    {0x1D4AE, 0x1D4B9}, {0x1D4BB, 0x1D4BB}, {0x1D4BD, 0x1D4C3}, {0x1D4C5, 0x1D505}, {0x1D507, 0x1D50A}, {0x1D50D, 0x1D514},
+    {0x1D516, 0x1D51C}, {0x1D51E, 0x1D539}, {0x1D53B, 0x1D53E}, {0x1D540, 0x1D544}, {0x1D546, 0x1D546}, {0x1D54A, 0x1D550},
+    {0x1D552, 0x1D6A5}, {0x1D6A8, 0x1D6C0}, {0x1D6C2, 0x1D6DA}, {0x1D6DC, 0x1D6FA}, {0x1D6FC, 0x1D714}, {0x1D716, 0x1D734},
+    {0x1D736, 0x1D74E}, {0x1D750, 0x1D76E}, {0x1D770, 0x1D788}, {0x1D78A, 0x1D7A8}, {0x1D7AA, 0x1D7C2}, {0x1D7C4, 0x1D7CB},
+    {0x1D7CE, 0x1D7FF}, {0x1DA00, 0x1DA36}, {0x1DA3B, 0x1DA6C}, {0x1DA75, 0x1DA75}, {0x1DA84, 0x1DA84}, {0x1DA9B, 0x1DA9F},
+    {0x1DAA1, 0x1DAAF}, {0x1DF00, 0x1DF1E}, {0x1E000, 0x1E006}, {0x1E008, 0x1E018}, {0x1E01B, 0x1E021}, {0x1E023, 0x1E024},
+    {0x1E026, 0x1E02A}, {0x1E100, 0x1E12C}, {0x1E130, 0x1E13D}, {0x1E140, 0x1E149}, {0x1E14E, 0x1E14E}, {0x1E290, 0x1E2AE},
+    {0x1E2C0, 0x1E2F9}, {0x1E7E0, 0x1E7E6}, {0x1E7E8, 0x1E7EB}, {0x1E7ED, 0x1E7EE}, {0x1E7F0, 0x1E7FE}, {0x1E800, 0x1E8C4},
+    {0x1E8D0, 0x1E8D6}, {0x1E900, 0x1E94B}, {0x1E950, 0x1E959}, {0x1EE00, 0x1EE03}, {0x1EE05, 0x1EE1F}, {0x1EE21, 0x1EE22},
+    {0x1EE24, 0x1EE24}, {0x1EE27, 0x1EE27}, {0x1EE29, 0x1EE32}, {0x1EE34, 0x1EE37}, {0x1EE39, 0x1EE39}, {0x1EE3B, 0x1EE3B},
+    {0x1EE42, 0x1EE42}, {0x1EE47, 0x1EE47}, {0x1EE49, 0x1EE49}, {0x1EE4B, 0x1EE4B}, {0x1EE4D, 0x1EE4F}, {0x1EE51, 0x1EE52},
+    {0x1EE54, 0x1EE54}, {0x1EE57, 0x1EE57}, {0x1EE59, 0x1EE59}, {0x1EE5B, 0x1EE5B}, {0x1EE5D, 0x1EE5D}, {0x1EE5F, 0x1EE5F},
+    {0x1EE61, 0x1EE62}, {0x1EE64, 0x1EE64}, {0x1EE67, 0x1EE6A}, {0x1EE6C, 0x1EE72}, {0x1EE74, 0x1EE77}, {0x1EE79, 0x1EE7C},
+    {0x1EE7E, 0x1EE7E}, {0x1EE80, 0x1EE89}, {0x1EE8B, 0x1EE9B}, {0x1EEA1, 0x1EEA3}, {0x1EEA5, 0x1EEA9}, {0x1EEAB, 0x1EEBB},
+    {0x1FBF0, 0x1FBF9}, {0x20000, 0x2A6DF}, {0x2A700, 0x2B738}, {0x2B740, 0x2B81D}, {0x2B820, 0x2CEA1}, {0x2CEB0, 0x2EBE0},
+    {0x2F800, 0x2FA1D}, {0x30000, 0x3134A}, {0xE0100, 0xE01EF},
+};
+
+template <size_t N>
+static bool inRanges(const CodePointRange (&ranges)[N], uint32_t cp) {
+    auto it = std::upper_bound(ranges, ranges + N, cp, [](uint32_t cp, const CodePointRange &r) { return cp < r.first; });
+    return it != ranges && cp <= (it - 1)->last;
+}
+
+// decodeUtf8 - decode the sequence at p (of at most avail bytes) into cp; returns its length,
+// or 0 if it is malformed, overlong, a surrogate or out of range.
+static unsigned decodeUtf8(const unsigned char *p, size_t avail, uint32_t &cp) {
+    unsigned len = p[0] >= 0xf0 ? 4 : p[0] >= 0xe0 ? 3 : p[0] >= 0xc0 ? 2 : 0;
+    if (!len || len > avail || p[0] >= 0xf5)
+        return 0;
+    cp = p[0] & (0x7f >> len);
+    for (unsigned i = 1; i != len; ++i) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (p[i] & 0x3f);
     }
+    static const uint32_t kMinForLength[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (cp < kMinForLength[len] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+        return 0;
+    return len;
+}
+
+/*
+takeUnicodeIdentChar - the DFA stopped at the non-ASCII byte at input_pos. If state is the start
+of a token or inside an identifier, and the code point there may appear in that position, consume
+it and continue as an identifier. Returns false if the code point ends the token.
+*/
+static bool takeUnicodeIdentChar(unsigned &state, size_t &begin) {
+    if (state != LexerDFA::kStart && Dfa.accept[state] == tok_number)
+        return false;
+
+    // a sequence is at most 4 bytes; don't let the end of the window cut it.
+    while (input_len - input_pos < 4 && refillWindow(begin))
+        begin = 0;
+
+    uint32_t cp;
+    unsigned len = decodeUtf8((const unsigned char *)window.data() + input_pos, input_len - input_pos, cp);
+    if (!len || !(state == LexerDFA::kStart ? inRanges(XidStart, cp) : inRanges(XidContinue, cp)))
+        return false;
+    input_pos += len;
+    state = LexerDFA::kIdent;
+    return true;
+}
+
+
+// GetTok - return the next token from the input source
+static int getTok() { 
+    // Skip any whitespace.
+    do {
+        while (input_pos != input_len && (CharClasses.of[(unsigned char)window[input_pos]] & cc_space))
+            ++input_pos;
+    } while (input_pos == input_len && refillWindow(input_pos));
+    tok_start = inputOffset();
 
     // Check for EOF & Don't eat the EOF
-    if (last_char == EOF)
+    if (input_pos == input_len)
         return tok_eof;
 
+    // identifier, keyword or number: run the DFA over the window until the next byte would end
+    // the token, refilling behind the token if it runs off the end of the window. The DFA only
+    // sees runs known to be pure ASCII; non-ASCII bytes are decoded one code point at a time.
+    unsigned state = LexerDFA::kStart;
+    size_t begin = input_pos;
+    while (true) {
+        const char *p = window.data() + input_pos, *end = window.data() + asciiRunEnd();
+        for (; p != end; ++p) {
+            unsigned next = Dfa.next[state][(unsigned char)*p];
+            if (!next)
+                break;
+            state = next;
+        }
+        input_pos = p - window.data();
+        if (p != end)
+            break;
+        if (input_pos != input_len) {
+            if (!takeUnicodeIdentChar(state, begin))
+                break;
+        }
+        else if (refillWindow(begin))
+            begin = 0; // the refill moved the token to the front of the window
+        else
+            break;
+    }
+
+    // the text goes to identifier_str either way; numbers are converted from it.
+    if (int token = Dfa.accept[state]) {
+        identifier_str.assign(window.data() + begin, input_pos - begin);
+        // fill in num_val
+        if (token == tok_number)
+            num_val = strtod(identifier_str.c_str(), 0);
+        return token;
+    }
+
     // Otherwise, return the character as its ASCII value.
-    int this_char = last_char;
-    last_char = getchar();
-    return this_char;
+    return (unsigned char)window[input_pos++];
 }
 
 
@@ -72,10 +1051,145 @@ static int getTok() {
 // Abstract Syntax Tree
 //-----------------------------------------------------------------------------------
 
+/*
+Arena - bump allocator for the AST of one top-level expression. While an ArenaScope is active,
+AST nodes are carved out of the arena and deleting them is a no-op; leaving the scope rewinds the
+arena but keeps its blocks, so a steady stream of expressions is parsed without touching the heap.
+*/
+class Arena {
+    static constexpr size_t kBlockSize = 64 * 1024;
+    struct Block {
+        char *data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t cur_block = 0, used = 0;
+
+public:
+    ~Arena() {
+        for (Block &block : blocks)
+            ::operator delete(block.data);
+    }
+
+    void *allocate(size_t size) {
+        size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        for (; cur_block < blocks.size(); ++cur_block, used = 0) {
+            if (used + size <= blocks[cur_block].size) {
+                void *p = blocks[cur_block].data + used;
+                used += size;
+                return p;
+            }
+        }
+        size_t block_size = std::max(kBlockSize, size);
+        blocks.push_back({(char *)::operator new(block_size), block_size});
+        used = size;
+        return blocks.back().data;
+    }
+
+    bool owns(const void *p) const {
+        for (const Block &block : blocks)
+            if (p >= block.data && p < block.data + block.size)
+                return true;
+        return false;
+    }
+
+    void reset() {
+        cur_block = 0;
+        used = 0;
+    }
+
+    size_t reservedBytes() const {
+        size_t total = 0;
+        for (const Block &block : blocks)
+            total += block.size;
+        return total;
+    }
+};
+
+static Arena ItemArena;
+static bool item_arena_active = false;
+
+// ArenaAllocated - AST classes derive from this to be allocated from ItemArena while it is active.
+// Its operators stay out of line: inlined into callers, GCC warns about mismatched new/delete pairs.
+struct ArenaAllocated {
+    __attribute__((noinline)) static void *operator new(size_t size) {
+        return item_arena_active ? ItemArena.allocate(size) : ::operator new(size);
+    }
+    __attribute__((noinline)) static void operator delete(void *p) {
+        if (!ItemArena.owns(p))
+            ::operator delete(p);
+    }
+};
+
+/*
+Structural hashing - every node carries a 64-bit Merkle hash over its kind, operator, literal or
+name and its children's hashes, computed by its constructor, i.e. in the same pass as parsing.
+Calls hash their callee's current definition, so the hash of a function covers everything it can
+reach and ignores whitespace and formatting. Variables hash by parameter slot, not by name, so
+alpha-equivalent functions (equal up to parameter names) hash alike. Hashes are stable across
+runs, builds and files; std::hash is not used for that reason.
+*/
+static constexpr uint64_t mixHash(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static constexpr uint64_t hashCombine(uint64_t seed, uint64_t value) {
+    return mixHash(seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+static uint64_t hashString(const std::string &str) {
+    uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+    for (unsigned char c : str)
+        h = (h ^ c) * 0x100000001b3ull;
+    return mixHash(h);
+}
+
+static uint64_t hashDouble(double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    return mixHash(bits);
+}
+
+enum class ExprKind : uint8_t {
+    number = 1,
+    variable,
+    binary,
+    call,
+    conditional,
+};
+
 // ExprAST - Base class for all expression nodes.
-class ExprAST {
+class ExprAST : public ArenaAllocated {
+    ExprKind kind;
+
+protected:
+    uint64_t hash = 0; // structural hash of this subtree
+    bool pure = true;  // evaluating this subtree has no side effects
+
 public:
+    ExprAST(ExprKind kind) : kind(kind) {}
     virtual ~ExprAST() = default;
+
+    ExprKind getKind() const { return kind; }
+    uint64_t getHash() const { return hash; }
+    bool isPure() const { return pure; }
+
+    // rehash - recompute hash and purity of this subtree, after a callee was redefined.
+    virtual void rehash() = 0;
+
+    // eval - evaluate this expression, args holds the values of the enclosing function's parameters.
+    virtual double eval(const double *args) const = 0;
+
+    // clone - a deep copy, for passes that duplicate or rebuild subtrees.
+    virtual std::unique_ptr<ExprAST> clone() const = 0;
+
+    // countNodes / depth - size and height of this subtree.
+    virtual unsigned countNodes() const = 0;
+    virtual unsigned depth() const = 0;
 };
 
 
@@ -84,16 +1198,31 @@ class NumberExprAST : public ExprAST {
     double val;
 
 public:
-    NumberExprAST(double val) : val(val) {}
+    NumberExprAST(double val) : ExprAST(ExprKind::number), val(val) { rehash(); }
+    double getVal() const { return val; }
+    void rehash() override { hash = hashCombine((uint64_t)ExprKind::number, hashDouble(val)); }
+    double eval(const double *args) const override;
+    std::unique_ptr<ExprAST> clone() const override { return std::make_unique<NumberExprAST>(val); }
+    unsigned countNodes() const override { return 1; }
+    unsigned depth() const override { return 1; }
 };
 
 
 // VaraibleExprAST - Expression class for referencing a varaible, like "a".
+// index is the position of the variable in the enclosing prototype's argument list.
 class VariableExprAST : public ExprAST {
     std::string name;
+    unsigned index;
 
 public:
-    VariableExprAST(const std::string &name) : name(name) {}
+    VariableExprAST(const std::string &name, unsigned index) : ExprAST(ExprKind::variable), name(name), index(index) { rehash(); }
+    const std::string &getName() const { return name; }
+    unsigned getIndex() const { return index; }
+    void rehash() override { hash = hashCombine((uint64_t)ExprKind::variable, index); }
+    double eval(const double *args) const override;
+    std::unique_ptr<ExprAST> clone() const override { return std::make_unique<VariableExprAST>(name, index); }
+    unsigned countNodes() const override { return 1; }
+    unsigned depth() const override { return 1; }
 };
 
 
@@ -103,42 +1232,550 @@ class BinaryExprAST : public ExprAST {
     std::unique_ptr<ExprAST> lhs, rhs;
 
 public:
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+    BinaryExprAST(char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) : ExprAST(ExprKind::binary), op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {
+        updateHash();
+    }
+
+    char getOp() const { return op; }
+    const ExprAST &getLHS() const { return *lhs; }
+    const ExprAST &getRHS() const { return *rhs; }
+    std::unique_ptr<ExprAST> &mutableLHS() { return lhs; }
+    std::unique_ptr<ExprAST> &mutableRHS() { return rhs; }
+
+    void updateHash() {
+        hash = hashCombine(hashCombine(hashCombine((uint64_t)ExprKind::binary, (unsigned char)op), lhs->getHash()), rhs->getHash());
+        pure = lhs->isPure() && rhs->isPure();
+    }
+    void rehash() override {
+        lhs->rehash();
+        rhs->rehash();
+        updateHash();
+    }
+
+    double eval(const double *args) const override;
+    std::unique_ptr<ExprAST> clone() const override { return std::make_unique<BinaryExprAST>(op, lhs->clone(), rhs->clone()); }
+    unsigned countNodes() const override { return 1 + lhs->countNodes() + rhs->countNodes(); }
+    unsigned depth() const override { return 1 + std::max(lhs->depth(), rhs->depth()); }
 };
 
 
+struct FunctionEntry;
+
 // CallExprAST - Expression class for function calls.
+// target is resolved by the parser, so calls never look the callee up by name at run time.
+// self_call marks a definition calling itself, whose hash cannot include its own.
 class CallExprAST : public ExprAST {
     std::string callee;
     std::vector<std::unique_ptr<ExprAST>> args;
+    const FunctionEntry *target;
+    bool self_call;
+    bool tail = false; // a self call whose value is the function's value
 
 public:
-    CallExprAST(const std::string &callee, std::vector<std::unique_ptr<ExprAST>> args) : callee(callee), args(std::move(args)) {}
-};
+    CallExprAST(const std::string &callee, std::vector<std::unique_ptr<ExprAST>> args, const FunctionEntry *target, bool self_call)
+        : ExprAST(ExprKind::call), callee(callee), args(std::move(args)), target(target), self_call(self_call) {
+        updateHash();
+    }
 
+    const FunctionEntry *getTarget() const { return target; }
+    const std::vector<std::unique_ptr<ExprAST>> &getArgs() const { return args; }
+    bool isSelfCall() const { return self_call; }
+    bool isTailCall() const { return tail; }
+    void setTail(bool tail) { this->tail = tail; }
+    const std::string &getCallee() const { return callee; }
+    std::vector<std::unique_ptr<ExprAST>> &mutableArgs() { return args; }
 
-// PrototypeAST - represents the "prototype" for a function,
-// which captures its name, and its argument names (thus implicitly the number of arguments the function takes)
-class PrototypeAST {
-    std::string name;
-    std::vector<std::string> args;
+    void updateHash();
+    void rehash() override {
+        for (auto &arg : args)
+            arg->rehash();
+        updateHash();
+    }
 
-public:
-    PrototypeAST(const std::string &name, std::vector<std::string> args) : name(name), args(std::move(args)) {}
+    double eval(const double *args) const override;
 
-    const std::string &getName() const { return name; }
+    std::unique_ptr<ExprAST> clone() const override {
+        std::vector<std::unique_ptr<ExprAST>> copies;
+        for (const auto &arg : args)
+            copies.push_back(arg->clone());
+        return std::make_unique<CallExprAST>(callee, std::move(copies), target, self_call);
+    }
+
+    unsigned countNodes() const override {
+        unsigned n = 1;
+        for (const auto &arg : args)
+            n += arg->countNodes();
+        return n;
+    }
+    unsigned depth() const override {
+        unsigned d = 0;
+        for (const auto &arg : args)
+            d = std::max(d, arg->depth());
+        return 1 + d;
+    }
 };
 
 
+// IfExprAST - Expression class for if/then/else.
+class IfExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> cond, then_expr, else_expr;
+
+public:
+    IfExprAST(std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> then_expr, std::unique_ptr<ExprAST> else_expr)
+        : ExprAST(ExprKind::conditional), cond(std::move(cond)), then_expr(std::move(then_expr)), else_expr(std::move(else_expr)) {
+        updateHash();
+    }
+
+    const ExprAST &getCond() const { return *cond; }
+    const ExprAST &getThen() const { return *then_expr; }
+    const ExprAST &getElse() const { return *else_expr; }
+    std::unique_ptr<ExprAST> &mutableCond() { return cond; }
+    std::unique_ptr<ExprAST> &mutableThen() { return then_expr; }
+    std::unique_ptr<ExprAST> &mutableElse() { return else_expr; }
+
+    void updateHash() {
+        hash = hashCombine(hashCombine(hashCombine((uint64_t)ExprKind::conditional, cond->getHash()), then_expr->getHash()), else_expr->getHash());
+        pure = cond->isPure() && then_expr->isPure() && else_expr->isPure();
+    }
+    void rehash() override {
+        cond->rehash();
+        then_expr->rehash();
+        else_expr->rehash();
+        updateHash();
+    }
+
+    double eval(const double *args) const override;
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<IfExprAST>(cond->clone(), then_expr->clone(), else_expr->clone());
+    }
+    unsigned countNodes() const override { return 1 + cond->countNodes() + then_expr->countNodes() + else_expr->countNodes(); }
+    unsigned depth() const override { return 1 + std::max(cond->depth(), std::max(then_expr->depth(), else_expr->depth())); }
+};
+
+
+// PrototypeAST - represents the "prototype" for a function,
+// which captures its name, and its argument names (thus implicitly the number of arguments the function takes)
+// its hash covers only the arity, so identical functions hash alike whatever they and their parameters are called.
+class PrototypeAST : public ArenaAllocated {
+    std::string name;
+    std::vector<std::string> args;
+    uint64_t hash;
+
+public:
+    PrototypeAST(const std::string &name, std::vector<std::string> args) : name(name), args(std::move(args)) {
+        hash = hashCombine(0x70726f746full, this->args.size());
+    }
+
+    const std::string &getName() const { return name; }
+    const std::vector<std::string> &getArgs() const { return args; }
+    uint64_t getHash() const { return hash; }
+};
+
+
+class LinearFunction;
+class ClosureFunction;
+class JitFunction;
+
 // FunctionAST - represents a function definition itself.
-class FunctionAST {
+// linear, closure and jit are its body compiled for those engines, built once on definition.
+class FunctionAST : public ArenaAllocated {
     std::unique_ptr<PrototypeAST> proto;
     std::unique_ptr<ExprAST> body;
 
 public:
+    std::unique_ptr<LinearFunction> linear;
+    std::unique_ptr<ClosureFunction> closure;
+    std::unique_ptr<JitFunction> jit;
+
     FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body) : proto(std::move(proto)), body(std::move(body)) {}
+    ~FunctionAST();
+
+    const PrototypeAST &getProto() const { return *proto; }
+    const ExprAST &getBody() const { return *body; }
+    std::unique_ptr<ExprAST> &mutableBody() { return body; }
+    uint64_t getHash() const { return hashCombine(proto->getHash(), body->getHash()); }
+    void rehash() { body->rehash(); }
+    double eval(const double *args) const;
+};
+
+
+// CostEstimate - what estimatedCost() expects one call of a function to cost.
+struct CostEstimate {
+    double per_call = 0; // operations of a single activation, not counting the calls that recurse
+    double total = 0;    // operations of the whole call, recursion included
+    bool recursive = false;
+};
+
+// FunctionEntry - everything callable by name: user definitions and externs bound to native code.
+// hash and pure describe the current definition, and are what calls to it hash and inherit.
+// def is shared when deduplication merged this function into an alpha-equivalent one.
+struct FunctionEntry {
+    std::shared_ptr<FunctionAST> def;               // filled in by 'def'
+    double (*native)(const double *args) = nullptr; // filled in by 'extern' of a known native
+    unsigned arity = 0;
+    bool declared = false; // a definition or extern has been installed
+    uint64_t hash = 0;
+    bool pure = false;
+    mutable CostEstimate cost;      // valid while cost_known
+    mutable bool cost_known = false;
+    mutable unsigned cost_depth = 0; // while being estimated, 1 + its depth on the estimation stack
+};
+
+void CallExprAST::updateHash() {
+    // a self call stands for "this function", known to have the arity being called with.
+    uint64_t callee_hash = self_call ? hashCombine(0x73656c66ull, args.size()) : target->hash;
+    hash = hashCombine((uint64_t)ExprKind::call, callee_hash);
+    pure = self_call || target->pure;
+    for (const auto &arg : args) {
+        hash = hashCombine(hash, arg->getHash());
+        pure = pure && arg->isPure();
+    }
+}
+
+// FunctionTable - every function declared so far. std::map never moves its nodes,
+// so CallExprAST can keep a pointer to an entry across redefinitions.
+static std::map<std::string, FunctionEntry> FunctionTable;
+
+
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------
+// Metrics
+//-------------------------------------------------------------------------------------------------------------------------------------------------
+
+/*
+Counters and histograms are sharded per thread: each thread bumps its own cache line with a relaxed
+atomic add, and readers sum the shards. Exporting (file or socket) only ever reads, so updates never contend.
+*/
+static constexpr unsigned kMetricShards = 16;
+
+static unsigned metricShard() {
+    static std::atomic<unsigned> next_shard{0};
+    thread_local unsigned shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+    return shard;
+}
+
+// ShardedCounter - a monotonically increasing counter.
+class ShardedCounter {
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    Shard shards[kMetricShards];
+
+public:
+    void add(uint64_t n = 1) { shards[metricShard()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Shard &shard : shards)
+            total += shard.value.load(std::memory_order_relaxed);
+        return total;
+    }
+};
+
+// LatencyHistogram - a fixed-bucket latency histogram, exported as a Prometheus histogram in seconds.
+class LatencyHistogram {
+public:
+    static constexpr unsigned kBuckets = 14;
+    static constexpr uint64_t kBoundsNs[kBuckets] = {
+        1000, 5000, 10000, 50000, 100000, 500000, 1000000,
+        5000000, 10000000, 50000000, 100000000, 500000000, 1000000000, 5000000000,
+    };
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[kBuckets + 1] = {}; // last bucket is +Inf
+        std::atomic<uint64_t> sum_ns{0};
+    };
+    Shard shards[kMetricShards];
+
+public:
+    void observe(uint64_t ns) {
+        unsigned bucket = 0;
+        while (bucket < kBuckets && ns > kBoundsNs[bucket])
+            ++bucket;
+        Shard &shard = shards[metricShard()];
+        shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    uint64_t count(unsigned bucket) const {
+        uint64_t total = 0;
+        for (const Shard &shard : shards)
+            total += shard.counts[bucket].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    uint64_t sumNs() const {
+        uint64_t total = 0;
+        for (const Shard &shard : shards)
+            total += shard.sum_ns.load(std::memory_order_relaxed);
+        return total;
+    }
+};
+
+/*
+HdrHistogram - latency histogram with bounded relative error over a wide range, in the style of
+HdrHistogram: each power of two is split into kHalf linear sub-buckets, so a recorded value is
+off by at most 1/kHalf (~3%) anywhere from 1ns to ~18 minutes. Recording is wait-free and
+readers may run concurrently, so the metrics exporter can report percentiles live.
+*/
+class HdrHistogram {
+    static constexpr unsigned kSubBits = 6;
+    static constexpr unsigned kHalf = 1u << (kSubBits - 1);
+    static constexpr unsigned kMaxBits = 40;
+    static constexpr unsigned kBuckets = (kMaxBits - kSubBits + 2) * kHalf;
+
+    std::atomic<uint64_t> counts[kBuckets] = {};
+    std::atomic<uint64_t> total{0}, sum_ns{0}, max_ns{0};
+
+    // below 2 * kHalf every value has its own bucket; above, a bucket spans 2^shift values.
+    static unsigned indexOf(uint64_t ns) {
+        ns = std::min<uint64_t>(ns, (1ull << kMaxBits) - 1);
+        if (ns < 2 * kHalf)
+            return ns;
+        unsigned shift = 63 - __builtin_clzll(ns) - (kSubBits - 1);
+        return shift * kHalf + (ns >> shift);
+    }
+
+    // highestValueOf - the largest value that lands in bucket i.
+    static uint64_t highestValueOf(unsigned i) {
+        if (i < 2 * kHalf)
+            return i;
+        unsigned shift = i / kHalf - 1;
+        uint64_t sub = i - shift * kHalf;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(uint64_t ns) {
+        counts[indexOf(ns)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t prev = max_ns.load(std::memory_order_relaxed);
+        while (prev < ns && !max_ns.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    void reset() {
+        for (auto &c : counts)
+            c.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum_ns.store(0, std::memory_order_relaxed);
+        max_ns.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sumNs() const { return sum_ns.load(std::memory_order_relaxed); }
+    uint64_t maxNs() const { return max_ns.load(std::memory_order_relaxed); }
+
+    // percentile - the value at or below which a fraction q of the samples fall.
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (!n)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(q * n));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i != kBuckets; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(highestValueOf(i), maxNs());
+        }
+        return maxNs();
+    }
+};
+
+// Metrics - everything the exporter publishes.
+static struct {
+    ShardedCounter tokens_lexed;
+    ShardedCounter items_parsed;
+    ShardedCounter parse_errors;
+    ShardedCounter cache_hits;
+    LatencyHistogram parse_latency;
+    LatencyHistogram eval_latency;
+    std::atomic<int64_t> arena_bytes{0}; // gauge
+    HdrHistogram request_latency;        // input completion to result, per top-level item
+} Metrics;
+
+// ArenaScope - allocate AST nodes from ItemArena until the scope ends, then rewind it.
+class ArenaScope {
+public:
+    ArenaScope() { item_arena_active = true; }
+    ~ArenaScope() {
+        item_arena_active = false;
+        ItemArena.reset();
+        Metrics.arena_bytes.store(ItemArena.reservedBytes(), std::memory_order_relaxed);
+    }
 };
 
+static uint64_t nanosSince(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static void appendCounter(std::string &out, const char *name, const char *help, uint64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+    out += line;
+}
+
+static void appendGauge(std::string &out, const char *name, const char *help, int64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, (long long)value);
+    out += line;
+}
+
+static void appendHistogram(std::string &out, const char *name, const char *help, const LatencyHistogram &h) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    out += line;
+
+    uint64_t cumulative = 0;
+    for (unsigned i = 0; i <= LatencyHistogram::kBuckets; ++i) {
+        cumulative += h.count(i);
+        if (i < LatencyHistogram::kBuckets)
+            snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, LatencyHistogram::kBoundsNs[i] / 1e9, (unsigned long long)cumulative);
+        else
+            snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.9f\n%s_count %llu\n", name, h.sumNs() / 1e9, name, (unsigned long long)cumulative);
+    out += line;
+}
+
+static void appendSummary(std::string &out, const char *name, const char *help, const HdrHistogram &h) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    out += line;
+    for (double q : {0.5, 0.99, 0.999}) {
+        snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9f\n", name, q, h.percentile(q) / 1e9);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.9f\n%s_count %llu\n", name, h.sumNs() / 1e9, name, (unsigned long long)h.count());
+    out += line;
+}
+
+// formatMetrics - render all metrics in the Prometheus text exposition format (version 0.0.4).
+static std::string formatMetrics() {
+    std::string out;
+    appendCounter(out, "kaleidoscope_tokens_lexed_total", "Tokens returned by the lexer.", Metrics.tokens_lexed.value());
+    appendCounter(out, "kaleidoscope_items_parsed_total", "Top-level items parsed successfully.", Metrics.items_parsed.value());
+    appendCounter(out, "kaleidoscope_parse_errors_total", "Top-level items that failed to parse.", Metrics.parse_errors.value());
+    appendCounter(out, "kaleidoscope_cache_hits_total", "Lookups served from a cache.", Metrics.cache_hits.value());
+    appendGauge(out, "kaleidoscope_arena_bytes", "Bytes currently reserved by AST arenas.", Metrics.arena_bytes.load(std::memory_order_relaxed));
+    appendHistogram(out, "kaleidoscope_parse_latency_seconds", "Time spent parsing one top-level item.", Metrics.parse_latency);
+    appendHistogram(out, "kaleidoscope_eval_latency_seconds", "Time spent evaluating one top-level expression.", Metrics.eval_latency);
+    appendSummary(out, "kaleidoscope_request_latency_seconds", "Time from input completion to result, per top-level item.", Metrics.request_latency);
+    return out;
+}
+
+// reportLatency - one-line p50/p99/p999 summary of request latency.
+static void reportLatency(FILE *out) {
+    const HdrHistogram &h = Metrics.request_latency;
+    fprintf(out, "request latency: n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", (unsigned long long)h.count(),
+            h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.maxNs() / 1e3);
+}
+
+// latency_report_requested - set by SIGUSR1, checked between top-level items.
+static volatile sig_atomic_t latency_report_requested = 0;
+
+static void requestLatencyReport(int) {
+    latency_report_requested = 1;
+}
+
+// writeMetricsFile - replace path atomically, so a scraper never sees a half-written file.
+static void writeMetricsFile(const std::string &path) {
+    std::string tmp_path = path + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Error: cannot write metrics file '%s'\n", tmp_path.c_str());
+        return;
+    }
+    std::string text = formatMetrics();
+    fwrite(text.data(), 1, text.size(), f);
+    fclose(f);
+    if (rename(tmp_path.c_str(), path.c_str()) != 0)
+        fprintf(stderr, "Error: cannot replace metrics file '%s'\n", path.c_str());
+}
+
+/*
+MetricsExporter - publishes Metrics from background threads:
+    - every interval_ms into a local text file, and once more on shutdown.
+    - over HTTP on 127.0.0.1:port, one scrape per connection.
+*/
+class MetricsExporter {
+    std::thread file_thread, socket_thread;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::atomic<bool> stopping{false};
+
+    void fileLoop(std::string path, unsigned interval_ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wakeup.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return stopping.load(); }))
+            writeMetricsFile(path);
+        writeMetricsFile(path);
+    }
+
+    void socketLoop(int listen_fd) {
+        while (!stopping) {
+            pollfd pfd = {listen_fd, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0)
+                continue;
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+
+            // we serve the same document for every path, so the request only needs draining.
+            char request[1024];
+            pollfd cfd = {fd, POLLIN, 0};
+            if (poll(&cfd, 1, 1000) > 0)
+                (void)!read(fd, request, sizeof(request));
+
+            std::string body = formatMetrics();
+            char header[128];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body.size());
+            (void)!write(fd, header, header_len);
+            (void)!write(fd, body.data(), body.size());
+            close(fd);
+        }
+        close(listen_fd);
+    }
+
+public:
+    void startFile(const std::string &path, unsigned interval_ms) {
+        file_thread = std::thread(&MetricsExporter::fileLoop, this, path, interval_ms);
+    }
+
+    bool startSocket(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return false;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+            close(fd);
+            return false;
+        }
+        socket_thread = std::thread(&MetricsExporter::socketLoop, this, fd);
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        if (file_thread.joinable())
+            file_thread.join();
+        if (socket_thread.joinable())
+            socket_thread.join();
+    }
+};
 
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------
@@ -151,296 +1788,3883 @@ cur_tok - current token the parser is now looking at.
 getNextToken() - reads another token from the 'lexer' & updates cur_tok with its results.
 */
 static int cur_tok;
+
+// time_lexer / lex_ns - when set, getNextToken() adds the time spent in the lexer to lex_ns.
+static bool time_lexer = false;
+static uint64_t lex_ns = 0;
+
 static int getNextToken() {
-    return cur_tok = getTok();
+    Metrics.tokens_lexed.add();
+    if (!time_lexer)
+        return cur_tok = getTok();
+
+    auto lex_start = Clock::now();
+    cur_tok = getTok();
+    lex_ns += nanosSince(lex_start);
+    return cur_tok;
+}
+
+// BinopPrecedence - this holds the precedence for each binary operator that is defined.
+static std::map<char, int> BinopPrecedence;
+
+// getTokPrecendence
+static int getTokPrecedence() {
+    if (!isascii(cur_tok)) // if tok is not binary operator
+        return -1;
+    
+    // make sure it's a declared binary operator.
+    int tok_prec = BinopPrecedence[cur_tok];
+    if (tok_prec <= 0) return -1;
+    return tok_prec;
+}
+
+// cur_proto - prototype of the definition being parsed, used to resolve variable references.
+// null while parsing a top-level expression.
+static const PrototypeAST *cur_proto = nullptr;
+
+// logError* - these are little helper functions for error handling.
+std::unique_ptr<ExprAST> logError(const char *str) {
+    fprintf(stderr, "Error: %s\n", str);
+    return nullptr;
+}
+std::unique_ptr<PrototypeAST> logErrorP(const char *str) {
+    logError(str);
+    return nullptr;
+}
+
+
+//------------------------------------------------------------------
+//Basic Expression Parsing
+
+static std::unique_ptr<ExprAST> parseExpression();
+
+
+// numberexpr ::= number
+static std::unique_ptr<ExprAST> parseNumberExpr() {
+    auto result = std::make_unique<NumberExprAST>(num_val);
+    getNextToken();
+    return std::move(result);
+}
+
+// parenexpr ::= '(' expression ')'
+static std::unique_ptr<ExprAST> parseParenExpr() {
+    getNextToken(); // eat (
+    auto v = parseExpression();
+    if (!v)
+        return nullptr;
+    
+    if (cur_tok != ')')
+        return logError("expected ')'");
+    getNextToken(); // eat )
+    return v;
+}
+
+// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static std::unique_ptr<ExprAST> parseIfExpr() {
+    getNextToken(); // eat if
+    auto cond = parseExpression();
+    if (!cond)
+        return nullptr;
+
+    if (cur_tok != tok_then)
+        return logError("expected then");
+    getNextToken(); // eat then
+    auto then_expr = parseExpression();
+    if (!then_expr)
+        return nullptr;
+
+    if (cur_tok != tok_else)
+        return logError("expected else");
+    getNextToken(); // eat else
+    auto else_expr = parseExpression();
+    if (!else_expr)
+        return nullptr;
+
+    return std::make_unique<IfExprAST>(std::move(cond), std::move(then_expr), std::move(else_expr));
 }
 
-// BinopPrecedence - this holds the precedence for each binary operator that is defined.
-static std::map<char, int> BinopPrecedence;
+/*
+identifierexpr
+    ::= identifier
+    ::= identifier '(' expression * ')'
+*/
+static std::unique_ptr<ExprAST> parseIdentifierExpr() {
+    std::string id_name = identifier_str;
+
+    getNextToken(); // eat identifier
+    
+    if (cur_tok != '(') { // simple varaible ref
+        if (cur_proto) {
+            const std::vector<std::string> &params = cur_proto->getArgs();
+            for (unsigned i = 0; i != params.size(); ++i)
+                if (params[i] == id_name)
+                    return std::make_unique<VariableExprAST>(id_name, i);
+        }
+        return logError("Unknown variable name");
+    }
+
+    // look up the callee; a definition may call itself.
+    auto callee = FunctionTable.find(id_name);
+    if (callee == FunctionTable.end())
+        return logError("Unknown function referenced");
+
+    // call
+    getNextToken(); // eat (
+    std::vector<std::unique_ptr<ExprAST>> args;
+    if (cur_tok != ')') {
+        while (true) {
+            if (auto arg = parseExpression())
+                args.push_back(std::move(arg));
+            else
+                return nullptr;
+
+            if (cur_tok == ')')
+                break;
+            
+            if (cur_tok != ',')
+                return logError("Expected ')' or ',' in argument list");
+            getNextToken();
+        }
+    }
+
+    // eat the ')'
+    getNextToken();
+
+    bool self_call = cur_proto && cur_proto->getName() == id_name;
+    return std::make_unique<CallExprAST>(id_name, std::move(args), &callee->second, self_call);
+}
+
+/*
+primary
+    ::= identifierexpr
+    ::= numberexpr
+    ::= parenexpr
+    ::= ifexpr
+*/
+static std::unique_ptr<ExprAST> parsePrimary() {
+    switch (cur_tok) {
+        default:
+            return logError("unknown token when expecting an expression");
+        case tok_identifier:
+            return parseIdentifierExpr();
+        case tok_number:
+            return parseNumberExpr();
+        case '(':
+            return parseParenExpr();
+        case tok_if:
+            return parseIfExpr();
+    }
+}
+
+/*
+binoprhs
+    ::= ('+' primary)*
+*/
+static std::unique_ptr<ExprAST> parseBinOpRHS(int expr_prec, std::unique_ptr<ExprAST> lhs) {
+    // if this is a binop, find its precedence.
+    while (true) {
+        int tok_prec = getTokPrecedence();
+
+        // if this is a binop that binds at least as tightly as the current binop,
+        // consume it, otherwise we are done.
+        if (tok_prec < expr_prec)
+            return lhs;
+        
+        // now know this is a binop.
+        int bin_op = cur_tok;
+        getNextToken(); // eat binop
+
+        // parse the primary expression after the binary operator.
+        auto rhs = parsePrimary();
+        if (!rhs)
+            return nullptr;
+
+        // if bin_op binds less tightly with rhs than the operator after rhs,
+        // let the pending operator take rhs as its lhs.
+        int next_prec = getTokPrecedence();
+        if (tok_prec < next_prec) {
+            rhs = parseBinOpRHS(tok_prec + 1, std::move(rhs));
+            if (!rhs)
+                return nullptr;
+        }
+
+        // merge lhs/rhs
+        lhs = std::make_unique<BinaryExprAST>(bin_op, std::move(lhs), std::move(rhs));
+    }
+}
+
+/*
+expression
+    ::= primary binoprhs
+*/
+static std::unique_ptr<ExprAST> parseExpression() {
+    auto lhs = parsePrimary();
+    if (!lhs)
+        return nullptr;
+
+    return parseBinOpRHS(0, std::move(lhs));
+}
+
+/*
+prototype
+    ::= id '(' id* ')'
+*/
+static std::unique_ptr<PrototypeAST> parsePrototype() {
+    if (cur_tok != tok_identifier)
+        return logErrorP("Expected function name in prototype");
+    
+    std::string fn_name = identifier_str;
+    getNextToken();
+
+    if (cur_tok != '(')
+        return logErrorP("Expected '(' in prototype");
+    
+    // read the list of argument names.
+    std::vector<std::string> arg_names;
+    while (getNextToken() == tok_identifier)
+        arg_names.push_back(identifier_str);
+    if (cur_tok != ')')
+        return logErrorP("Expected ')' in prototype");
+
+    // success
+    getNextToken(); // eat )
+
+    return std::make_unique<PrototypeAST>(fn_name, std::move(arg_names));
+}
+
+
+/// definition ::= 'def' prototype expression
+static std::unique_ptr<FunctionAST> parseDefinition() {
+    getNextToken(); // eat def
+    auto proto = parsePrototype();
+    if (!proto)
+        return nullptr;
+
+    // register the name before the body, so the body can call itself.
+    auto inserted = FunctionTable.emplace(proto->getName(), FunctionEntry());
+    cur_proto = proto.get();
+    auto e = parseExpression();
+    cur_proto = nullptr;
+
+    if (e)
+        return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
+
+    if (inserted.second)
+        FunctionTable.erase(inserted.first);
+    return nullptr;
+}
+
+
+/// topLevelexpr ::= expression
+static std::unique_ptr<FunctionAST> parseTopLevelExpr() {
+    if (auto e = parseExpression()) {
+        // make an anonymous proto.
+        auto proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
+        return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
+    }
+    return nullptr;
+}
+
+
+/// derive ::= 'derive' identifier prototype
+/// the prototype names the function and the parameters to differentiate with respect to.
+static std::unique_ptr<PrototypeAST> parseDerive(std::string &name) {
+    getNextToken(); // eat derive.
+    if (cur_tok != tok_identifier)
+        return logErrorP("Expected name of the derivative");
+    name = identifier_str;
+    getNextToken();
+    return parsePrototype();
+}
+
+/// external ::= 'extern' prototype
+static std::unique_ptr<PrototypeAST> parseExtern() {
+    getNextToken(); // eat extern.
+    return parsePrototype();
+}
+
+//---------------------------------------------------------------------
+// Evaluation
+//---------------------------------------------------------------------
+
+// eval_error - first error raised while evaluating the current top-level expression.
+static const char *eval_error = nullptr;
+
+static double logErrorEval(const char *str) {
+    if (!eval_error)
+        eval_error = str;
+    return 0.0;
+}
+
+/*
+With --precision single, a session computes in float: literals are rounded to float where an engine
+reads them, and so is the result of every operator and native call. Values stay in doubles, but the
+double sum, difference or product of two floats rounded to float is exactly the float result, so
+this is float arithmetic, not an approximation of it; natives are computed in double and rounded.
+*/
+static bool single_precision = false;
+
+// toSessionPrecision - v as the session's numeric type represents it.
+static inline double toSessionPrecision(double v) {
+    return single_precision ? (double)(float)v : v;
+}
+
+// PendingTailCall - a tail call returns its arguments here instead of recursing, and the
+// FunctionAST::eval it returns to runs the body again on them: self recursion in tail position
+// runs in constant stack.
+static thread_local struct {
+    const FunctionEntry *target = nullptr;
+    std::vector<double> args;
+} PendingTailCall;
+
+double FunctionAST::eval(const double *args) const {
+    double result = body->eval(args);
+    std::vector<double> frame;
+    while (const FunctionEntry *target = PendingTailCall.target) {
+        PendingTailCall.target = nullptr;
+        frame.swap(PendingTailCall.args);
+        if (target->def.get() != this)
+            return target->def->eval(frame.data());
+        result = body->eval(frame.data());
+    }
+    return result;
+}
+
+double NumberExprAST::eval(const double *) const {
+    return toSessionPrecision(val);
+}
+
+double VariableExprAST::eval(const double *args) const {
+    return args[index];
+}
+
+double IfExprAST::eval(const double *args) const {
+    return cond->eval(args) != 0.0 ? then_expr->eval(args) : else_expr->eval(args);
+}
+
+double BinaryExprAST::eval(const double *args) const {
+    double l = lhs->eval(args);
+    double r = rhs->eval(args);
+    switch (op) {
+        case '+':
+            return toSessionPrecision(l + r);
+        case '-':
+            return toSessionPrecision(l - r);
+        case '*':
+            return toSessionPrecision(l * r);
+        case '<':
+            return l < r ? 1.0 : 0.0;
+        default:
+            return logErrorEval("invalid binary operator");
+    }
+}
+
+double CallExprAST::eval(const double *args) const {
+    if (this->args.size() != target->arity)
+        return logErrorEval("Incorrect # arguments passed");
+
+    // evaluate the arguments into a new frame; small frames stay on the stack.
+    double small_frame[8];
+    std::vector<double> large_frame;
+    double *frame = small_frame;
+    if (this->args.size() > 8) {
+        large_frame.resize(this->args.size());
+        frame = large_frame.data();
+    }
+    for (unsigned i = 0; i != this->args.size(); ++i)
+        frame[i] = this->args[i]->eval(args);
+
+    if (tail && target->def) {
+        PendingTailCall.target = target;
+        PendingTailCall.args.assign(frame, frame + this->args.size());
+        return 0.0;
+    }
+    if (target->native)
+        return toSessionPrecision(target->native(frame));
+    if (target->def)
+        return target->def->eval(frame);
+    return logErrorEval("call to an extern without a native implementation");
+}
+
+//---------------------------------------------------------------------
+// Linearized Evaluation
+//---------------------------------------------------------------------
+
+/*
+A tree walk visits BinaryExprAST nodes wherever the allocator happened to put them. The linear
+engine instead copies each body into one contiguous array in post-order, i.e. evaluation order,
+and evaluates it as a forward sweep over that array with a value stack: every operand is produced
+just before the operator that consumes it, and the hardware prefetcher sees one linear stream.
+*/
+struct LinearOp {
+    enum Kind : uint8_t { number, variable, add, sub, mul, less, invalid, call, tail_call, jump_if_zero, jump, round_single } kind;
+    uint32_t nargs;                 // call, tail_call
+    union {
+        double val;                 // number
+        unsigned index;             // variable; jump target for jump_if_zero, jump
+        const FunctionEntry *target; // call, tail_call
+    };
+};
+
+class LinearFunction {
+    std::vector<LinearOp> code;
+    unsigned max_stack = 0;
+
+    void emit(const ExprAST &e, unsigned depth) {
+        LinearOp op = {};
+        switch (e.getKind()) {
+            case ExprKind::number:
+                op.kind = LinearOp::number;
+                op.val = toSessionPrecision(static_cast<const NumberExprAST &>(e).getVal());
+                break;
+            case ExprKind::variable:
+                op.kind = LinearOp::variable;
+                op.index = static_cast<const VariableExprAST &>(e).getIndex();
+                break;
+            case ExprKind::binary: {
+                auto &bin = static_cast<const BinaryExprAST &>(e);
+                emit(bin.getLHS(), depth);
+                emit(bin.getRHS(), depth + 1);
+                switch (bin.getOp()) {
+                    case '+': op.kind = LinearOp::add; break;
+                    case '-': op.kind = LinearOp::sub; break;
+                    case '*': op.kind = LinearOp::mul; break;
+                    case '<': op.kind = LinearOp::less; break;
+                    default: op.kind = LinearOp::invalid; break; // reported when it runs, as in the other engines
+                }
+                if (single_precision && op.kind != LinearOp::less && op.kind != LinearOp::invalid) {
+                    // in single precision, the result is rounded by an op of its own.
+                    code.push_back(op);
+                    op = LinearOp{LinearOp::round_single, 0, {}};
+                }
+                break;
+            }
+            case ExprKind::call: {
+                auto &call = static_cast<const CallExprAST &>(e);
+                for (size_t i = 0; i != call.getArgs().size(); ++i)
+                    emit(*call.getArgs()[i], depth + i);
+                op.kind = call.isTailCall() ? LinearOp::tail_call : LinearOp::call;
+                op.nargs = call.getArgs().size();
+                op.target = call.getTarget();
+                break;
+            }
+            case ExprKind::conditional: {
+                // cond; jump_if_zero else; then; jump end; else: else; end:
+                auto &cond = static_cast<const IfExprAST &>(e);
+                emit(cond.getCond(), depth);
+                size_t branch = code.size();
+                code.push_back(LinearOp{LinearOp::jump_if_zero, 0, {}});
+                emit(cond.getThen(), depth);
+                size_t skip = code.size();
+                code.push_back(LinearOp{LinearOp::jump, 0, {}});
+                code[branch].index = code.size();
+                emit(cond.getElse(), depth);
+                code[skip].index = code.size();
+                return;
+            }
+        }
+        code.push_back(op);
+        max_stack = std::max(max_stack, depth + 1);
+    }
+
+public:
+    // linearize - replace the code with body in post-order; keeps the capacity for reuse.
+    void linearize(const ExprAST &body) {
+        code.clear();
+        max_stack = 0;
+        emit(body, 0);
+    }
+
+    // run - evaluate; with kCountOps, also add the number of ops executed (callees included) to *ops.
+    // self calls in tail position jump back to the start instead of recursing.
+    template <bool kCountOps = false>
+    double run(const double *args, uint64_t *ops = nullptr) const;
+};
+
+// callLinear - call target with the nargs values at frame, preferring its linearized body.
+template <bool kCountOps>
+static double callLinear(const FunctionEntry *target, unsigned nargs, const double *frame, uint64_t *ops) {
+    if (nargs != target->arity)
+        return logErrorEval("Incorrect # arguments passed");
+    if (target->native)
+        return toSessionPrecision(target->native(frame));
+    if (!target->def)
+        return logErrorEval("call to an extern without a native implementation");
+    if (target->def->linear)
+        return target->def->linear->run<kCountOps>(frame, ops);
+    return target->def->eval(frame);
+}
+
+template <bool kCountOps>
+double LinearFunction::run(const double *args, uint64_t *ops) const {
+    double small_stack[32];
+    std::unique_ptr<double[]> large_stack;
+    double *sp = small_stack;
+    if (max_stack > 32) {
+        large_stack.reset(new double[max_stack]);
+        sp = large_stack.get();
+    }
+    double *const stack = sp;
+
+    // a self tail call loops: its arguments become this frame, owned here rather than by the caller.
+    double small_frame[8];
+    std::unique_ptr<double[]> large_frame;
+    double *frame = nullptr;
+
+    for (size_t pc = 0; pc != code.size();) {
+        const LinearOp &op = code[pc++];
+        if (kCountOps)
+            ++*ops;
+        switch (op.kind) {
+            case LinearOp::number:
+                *sp++ = op.val;
+                break;
+            case LinearOp::variable:
+                *sp++ = args[op.index];
+                break;
+            case LinearOp::add:
+                --sp;
+                sp[-1] = sp[-1] + sp[0];
+                break;
+            case LinearOp::sub:
+                --sp;
+                sp[-1] = sp[-1] - sp[0];
+                break;
+            case LinearOp::mul:
+                --sp;
+                sp[-1] = sp[-1] * sp[0];
+                break;
+            case LinearOp::less:
+                --sp;
+                sp[-1] = sp[-1] < sp[0] ? 1.0 : 0.0;
+                break;
+            case LinearOp::invalid:
+                --sp;
+                sp[-1] = logErrorEval("invalid binary operator");
+                break;
+            case LinearOp::call:
+                // the arguments are already contiguous on the stack: they are the callee's frame.
+                sp -= op.nargs;
+                *sp = callLinear<kCountOps>(op.target, op.nargs, sp, ops);
+                ++sp;
+                break;
+            case LinearOp::tail_call:
+                sp -= op.nargs;
+                if (op.nargs == op.target->arity && op.target->def && op.target->def->linear.get() == this) {
+                    if (!frame)
+                        frame = op.nargs <= 8 ? small_frame : (large_frame.reset(new double[op.nargs]), large_frame.get());
+                    std::copy(sp, sp + op.nargs, frame);
+                    args = frame;
+                    sp = stack;
+                    pc = 0;
+                    break;
+                }
+                *sp = callLinear<kCountOps>(op.target, op.nargs, sp, ops);
+                ++sp;
+                break;
+            case LinearOp::jump_if_zero:
+                if (*--sp == 0.0)
+                    pc = op.index;
+                break;
+            case LinearOp::jump:
+                pc = op.index;
+                break;
+            case LinearOp::round_single:
+                sp[-1] = (float)sp[-1];
+                break;
+        }
+    }
+    return sp[-1];
+}
+
+//---------------------------------------------------------------------
+// Closure Compilation
+//---------------------------------------------------------------------
+
+/*
+The closure engine compiles each body once into a tree of ClosureNodes, each holding a pointer to
+a function specialized for exactly what the node does: which operator, whether each operand is a
+literal, a parameter or another node, and how many arguments a call passes. Evaluating a node is
+one indirect call that reads its operands straight out of the node, with no switch on the node
+kind or operator and no virtual dispatch through the AST; literal and parameter operands cost no
+call at all. Compiling is a single walk that allocates the nodes in one block.
+*/
+struct ClosureNode;
+using ClosureFn = double (*)(const ClosureNode &node, const double *args);
+
+// ClosureNode - one compiled node; fn knows which of the operands below it uses and how.
+struct ClosureNode {
+    union Operand {
+        double val;              // literal
+        unsigned index;          // parameter
+        const ClosureNode *node; // anything else
+    };
+    ClosureFn fn;
+    Operand a, b, c;                        // binary: lhs, rhs; if: cond, then, else
+    const FunctionEntry *target;            // call
+    const ClosureNode *const *call_args;    // call
+    unsigned nargs;                         // call
+};
+
+// operand policies: where a specialized node finds an operand's value.
+struct FromNumber {
+    static double get(const ClosureNode::Operand &o, const double *) { return o.val; }
+};
+struct FromVariable {
+    static double get(const ClosureNode::Operand &o, const double *args) { return args[o.index]; }
+};
+struct FromNode {
+    static double get(const ClosureNode::Operand &o, const double *args) { return o.node->fn(*o.node, args); }
+};
+
+struct AddOp {
+    static double apply(double l, double r) { return l + r; }
+};
+struct SubOp {
+    static double apply(double l, double r) { return l - r; }
+};
+struct MulOp {
+    static double apply(double l, double r) { return l * r; }
+};
+struct LessOp {
+    static double apply(double l, double r) { return l < r ? 1.0 : 0.0; }
+};
+// Op computed in single precision; only compiled in when the session asks for it.
+template <class Op>
+struct SingleOp {
+    static double apply(double l, double r) { return (float)Op::apply(l, r); }
+};
+
+static double closureNumber(const ClosureNode &n, const double *) { return n.a.val; }
+static double closureVariable(const ClosureNode &n, const double *args) { return args[n.a.index]; }
+static double closureInvalid(const ClosureNode &, const double *) { return logErrorEval("invalid binary operator"); }
+
+template <class Op, class L, class R>
+static double closureBinary(const ClosureNode &n, const double *args) {
+    // the operands are sequenced, as in the tree engine: argument order is unspecified in C++.
+    double l = L::get(n.a, args);
+    return Op::apply(l, R::get(n.b, args));
+}
+
+static double closureIf(const ClosureNode &n, const double *args) {
+    const ClosureNode &branch = n.a.node->fn(*n.a.node, args) != 0.0 ? *n.b.node : *n.c.node;
+    return branch.fn(branch, args);
+}
+
+// callClosure - call target with the nargs values at frame, preferring its closure-compiled body.
+static double callClosure(const FunctionEntry *target, unsigned nargs, const double *frame);
+
+// closureCall - a call passing N arguments; kVariadic stands for any count, with a frame sized at run time.
+enum : unsigned { kVariadic = ~0u };
+
+template <unsigned N>
+static double closureCall(const ClosureNode &n, const double *args) {
+    double frame[N ? N : 1] = {}; // nullary calls still pass a valid pointer
+    for (unsigned i = 0; i != N; ++i)
+        frame[i] = n.call_args[i]->fn(*n.call_args[i], args);
+    return callClosure(n.target, N, frame);
+}
+
+template <>
+double closureCall<kVariadic>(const ClosureNode &n, const double *args) {
+    double small_frame[8];
+    std::vector<double> large_frame;
+    double *frame = small_frame;
+    if (n.nargs > 8) {
+        large_frame.resize(n.nargs);
+        frame = large_frame.data();
+    }
+    for (unsigned i = 0; i != n.nargs; ++i)
+        frame[i] = n.call_args[i]->fn(*n.call_args[i], args);
+    return callClosure(n.target, n.nargs, frame);
+}
+
+// closureTailCall - a self call in tail position hands its arguments to ClosureFunction::run, as in the tree engine.
+static double closureTailCall(const ClosureNode &n, const double *args) {
+    double small_frame[8];
+    std::vector<double> large_frame;
+    double *frame = small_frame;
+    if (n.nargs > 8) {
+        large_frame.resize(n.nargs);
+        frame = large_frame.data();
+    }
+    for (unsigned i = 0; i != n.nargs; ++i)
+        frame[i] = n.call_args[i]->fn(*n.call_args[i], args);
+    if (n.nargs != n.target->arity || !n.target->def)
+        return callClosure(n.target, n.nargs, frame);
+    PendingTailCall.target = n.target;
+    PendingTailCall.args.assign(frame, frame + n.nargs);
+    return 0.0;
+}
+
+// ClosureFunction - a body compiled into ClosureNodes.
+class ClosureFunction {
+    enum class Shape { number, variable, node };
+
+    std::vector<ClosureNode> nodes;               // reserved up front, so node pointers stay valid
+    std::vector<const ClosureNode *> call_args;   // likewise
+    const ClosureNode *root = nullptr;
+
+    template <class Op>
+    static ClosureFn pickBinary(Shape l, Shape r) {
+        static const ClosureFn table[3][3] = {
+            {closureBinary<Op, FromNumber, FromNumber>, closureBinary<Op, FromNumber, FromVariable>, closureBinary<Op, FromNumber, FromNode>},
+            {closureBinary<Op, FromVariable, FromNumber>, closureBinary<Op, FromVariable, FromVariable>, closureBinary<Op, FromVariable, FromNode>},
+            {closureBinary<Op, FromNode, FromNumber>, closureBinary<Op, FromNode, FromVariable>, closureBinary<Op, FromNode, FromNode>},
+        };
+        return table[(int)l][(int)r];
+    }
+
+    static unsigned countCallArgs(const ExprAST &e) {
+        switch (e.getKind()) {
+            case ExprKind::binary: {
+                auto &bin = static_cast<const BinaryExprAST &>(e);
+                return countCallArgs(bin.getLHS()) + countCallArgs(bin.getRHS());
+            }
+            case ExprKind::call: {
+                auto &call = static_cast<const CallExprAST &>(e);
+                unsigned count = call.getArgs().size();
+                for (const auto &arg : call.getArgs())
+                    count += countCallArgs(*arg);
+                return count;
+            }
+            case ExprKind::conditional: {
+                auto &cond = static_cast<const IfExprAST &>(e);
+                return countCallArgs(cond.getCond()) + countCallArgs(cond.getThen()) + countCallArgs(cond.getElse());
+            }
+            default:
+                return 0;
+        }
+    }
+
+    // operand - o as a literal or parameter read in place, or else a node compiled for e.
+    Shape operand(const ExprAST &e, ClosureNode::Operand &o) {
+        if (e.getKind() == ExprKind::number) {
+            o.val = toSessionPrecision(static_cast<const NumberExprAST &>(e).getVal());
+            return Shape::number;
+        }
+        if (e.getKind() == ExprKind::variable) {
+            o.index = static_cast<const VariableExprAST &>(e).getIndex();
+            return Shape::variable;
+        }
+        o.node = compile(e);
+        return Shape::node;
+    }
+
+    const ClosureNode *compile(const ExprAST &e) {
+        ClosureNode n = {};
+        switch (e.getKind()) {
+            case ExprKind::number:
+                n.fn = closureNumber;
+                n.a.val = toSessionPrecision(static_cast<const NumberExprAST &>(e).getVal());
+                break;
+            case ExprKind::variable:
+                n.fn = closureVariable;
+                n.a.index = static_cast<const VariableExprAST &>(e).getIndex();
+                break;
+            case ExprKind::binary: {
+                auto &bin = static_cast<const BinaryExprAST &>(e);
+                Shape l = operand(bin.getLHS(), n.a), r = operand(bin.getRHS(), n.b);
+                switch (bin.getOp()) {
+                    case '+': n.fn = single_precision ? pickBinary<SingleOp<AddOp>>(l, r) : pickBinary<AddOp>(l, r); break;
+                    case '-': n.fn = single_precision ? pickBinary<SingleOp<SubOp>>(l, r) : pickBinary<SubOp>(l, r); break;
+                    case '*': n.fn = single_precision ? pickBinary<SingleOp<MulOp>>(l, r) : pickBinary<MulOp>(l, r); break;
+                    case '<': n.fn = pickBinary<LessOp>(l, r); break;
+                    default: n.fn = closureInvalid; break;
+                }
+                break;
+            }
+            case ExprKind::call: {
+                auto &call = static_cast<const CallExprAST &>(e);
+                n.target = call.getTarget();
+                n.nargs = call.getArgs().size();
+                size_t first = call_args.size();
+                call_args.resize(first + n.nargs);
+                for (unsigned i = 0; i != n.nargs; ++i)
+                    call_args[first + i] = compile(*call.getArgs()[i]);
+                n.call_args = call_args.data() + first;
+                static const ClosureFn by_arity[] = {closureCall<0>, closureCall<1>, closureCall<2>, closureCall<3>, closureCall<4>};
+                if (call.isTailCall())
+                    n.fn = closureTailCall;
+                else
+                    n.fn = n.nargs < std::size(by_arity) ? by_arity[n.nargs] : closureCall<kVariadic>;
+                break;
+            }
+            case ExprKind::conditional: {
+                auto &cond = static_cast<const IfExprAST &>(e);
+                n.fn = closureIf;
+                n.a.node = compile(cond.getCond());
+                n.b.node = compile(cond.getThen());
+                n.c.node = compile(cond.getElse());
+                break;
+            }
+        }
+        nodes.push_back(n);
+        return &nodes.back();
+    }
+
+public:
+    // compileBody - replace the compiled code with body's; keeps the capacity for reuse.
+    void compileBody(const ExprAST &body) {
+        nodes.clear();
+        call_args.clear();
+        nodes.reserve(body.countNodes());
+        call_args.reserve(countCallArgs(body));
+        root = compile(body);
+    }
+
+    // run - evaluate; self calls in tail position loop here instead of recursing.
+    double run(const double *args) const {
+        double result = root->fn(*root, args);
+        std::vector<double> frame;
+        while (const FunctionEntry *target = PendingTailCall.target) {
+            PendingTailCall.target = nullptr;
+            frame.swap(PendingTailCall.args);
+            if (!target->def->closure || target->def->closure.get() != this)
+                return callClosure(target, frame.size(), frame.data());
+            result = root->fn(*root, frame.data());
+        }
+        return result;
+    }
+};
+
+static double callClosure(const FunctionEntry *target, unsigned nargs, const double *frame) {
+    if (nargs != target->arity)
+        return logErrorEval("Incorrect # arguments passed");
+    if (target->native)
+        return toSessionPrecision(target->native(frame));
+    if (!target->def)
+        return logErrorEval("call to an extern without a native implementation");
+    if (target->def->closure)
+        return target->def->closure->run(frame);
+    return target->def->eval(frame);
+}
+
+//---------------------------------------------------------------------
+// Copy-and-Patch JIT
+//---------------------------------------------------------------------
+
+/*
+The JIT engine emits x86-64 machine code without a compiler backend: every node shape has a
+stencil, a fixed sequence of instruction bytes with holes for its operands, and compiling a body
+is copying the stencils of its nodes in post-order into a buffer and patching the holes with
+literals, argument and stack-slot offsets, jump distances and call targets. The stencils are
+written out by hand here rather than extracted from compiled object files; the code is what an
+unoptimizing compiler would produce, and compiling costs a walk over the body plus one mmap.
+
+Generated functions have the C signature double (const double *args). rbx holds args, every value
+is computed into xmm0, and the left operand of a binary node waits in a stack slot, 8 bytes per
+depth of the value stack, while the right one is computed; a right operand that is a literal or
+a parameter is used in place. Calls leave their arguments in consecutive slots and call jitCall()
+with a pointer to them. A self call in tail position copies its arguments into a frame area of
+its own stack frame, points rbx at it and jumps back to the start of the body.
+*/
+#ifdef KALEIDOSCOPE_HAVE_JIT
+namespace stencil {
+// each stencil's holes are named by the byte offset of the value patched in.
+
+// push rbp; mov rbp, rsp; push rbx; mov rbx, rdi; sub rsp, imm32
+static const uint8_t kPrologue[] = {0x55, 0x48, 0x89, 0xE5, 0x53, 0x48, 0x89, 0xFB, 0x48, 0x81, 0xEC, 0, 0, 0, 0};
+static const size_t kPrologueFrame = 11;
+// add rsp, imm32; pop rbx; pop rbp; ret
+static const uint8_t kEpilogue[] = {0x48, 0x81, 0xC4, 0, 0, 0, 0, 0x5B, 0x5D, 0xC3};
+static const size_t kEpilogueFrame = 3;
+
+// movabs rax, imm64; movq xmm0, rax
+static const uint8_t kLiteral[] = {0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0x66, 0x48, 0x0F, 0x6E, 0xC0};
+static const size_t kLiteralValue = 2;
+// movsd xmm0, [rbx + disp32]
+static const uint8_t kArgument[] = {0xF2, 0x0F, 0x10, 0x83, 0, 0, 0, 0};
+static const size_t kArgumentOffset = 4;
+// movsd [rsp + disp32], xmm0
+static const uint8_t kSpill[] = {0xF2, 0x0F, 0x11, 0x84, 0x24, 0, 0, 0, 0};
+static const size_t kSpillSlot = 5;
+
+// the right operand into xmm1: movapd xmm1, xmm0; movsd xmm0, [rsp + disp32] (the spilled left operand)
+static const uint8_t kReloadLeft[] = {0x66, 0x0F, 0x28, 0xC8, 0xF2, 0x0F, 0x10, 0x84, 0x24, 0, 0, 0, 0};
+static const size_t kReloadLeftSlot = 9;
+// movabs rax, imm64; movq xmm1, rax
+static const uint8_t kLiteralRight[] = {0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0x66, 0x48, 0x0F, 0x6E, 0xC8};
+static const size_t kLiteralRightValue = 2;
+// movsd xmm1, [rbx + disp32]
+static const uint8_t kArgumentRight[] = {0xF2, 0x0F, 0x10, 0x8B, 0, 0, 0, 0};
+static const size_t kArgumentRightOffset = 4;
+
+// xmm0 = xmm0 op xmm1
+static const uint8_t kAdd[] = {0xF2, 0x0F, 0x58, 0xC1}; // addsd xmm0, xmm1
+static const uint8_t kSub[] = {0xF2, 0x0F, 0x5C, 0xC1}; // subsd xmm0, xmm1
+static const uint8_t kMul[] = {0xF2, 0x0F, 0x59, 0xC1}; // mulsd xmm0, xmm1
+// cmpltsd xmm0, xmm1; movabs rax, 1.0; movq xmm1, rax; andpd xmm0, xmm1 - all-ones or zero, masked to 1.0 or 0.0
+static const uint8_t kLess[] = {0xF2, 0x0F, 0xC2, 0xC1, 0x01, 0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0xF0, 0x3F,
+                                0x66, 0x48, 0x0F, 0x6E, 0xC8, 0x66, 0x0F, 0x54, 0xC1};
+// cvtsd2ss xmm0, xmm0; cvtss2sd xmm0, xmm0 - round to single precision, after each operator in that mode
+static const uint8_t kRoundToSingle[] = {0xF2, 0x0F, 0x5A, 0xC0, 0xF3, 0x0F, 0x5A, 0xC0};
+
+// xorpd xmm1, xmm1; ucomisd xmm0, xmm1; jp +6; je rel32 - a NaN condition is true, as in the other engines
+static const uint8_t kBranchIfZero[] = {0x66, 0x0F, 0x57, 0xC9, 0x66, 0x0F, 0x2E, 0xC1, 0x7A, 0x06, 0x0F, 0x84, 0, 0, 0, 0};
+static const size_t kBranchIfZeroTarget = 12;
+// jmp rel32
+static const uint8_t kJump[] = {0xE9, 0, 0, 0, 0};
+static const size_t kJumpTarget = 1;
+
+// jitCall(target, rsp + disp32, nargs): mov rdi, imm64; lea rsi, [rsp + disp32]; mov edx, imm32; movabs rax, imm64; call rax
+static const uint8_t kCall[] = {0x48, 0xBF, 0, 0, 0, 0, 0, 0, 0, 0, 0x48, 0x8D, 0xB4, 0x24, 0, 0, 0, 0,
+                                0xBA, 0, 0, 0, 0, 0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xD0};
+static const size_t kCallTarget = 2, kCallFrame = 14, kCallNargs = 19, kCallHelper = 25;
+// movsd xmm0, [rsp + disp32]; movsd [rsp + disp32], xmm0
+static const uint8_t kCopySlot[] = {0xF2, 0x0F, 0x10, 0x84, 0x24, 0, 0, 0, 0, 0xF2, 0x0F, 0x11, 0x84, 0x24, 0, 0, 0, 0};
+static const size_t kCopySlotFrom = 5, kCopySlotTo = 14;
+// lea rbx, [rsp + disp32]
+static const uint8_t kRebaseArguments[] = {0x48, 0x8D, 0x9C, 0x24, 0, 0, 0, 0};
+static const size_t kRebaseArgumentsFrame = 4;
+} // namespace stencil
+
+static double jitCall(const FunctionEntry *target, const double *frame, unsigned nargs);
+
+// JitFunction - a body compiled to machine code in a mapping of its own.
+class JitFunction {
+    std::vector<uint8_t> code;   // assembled here, then copied into the mapping
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+    double (*entry)(const double *args) = nullptr;
+    unsigned max_slots = 0;      // value stack depth
+    unsigned tail_frame = 0;     // arguments a self tail call passes
+    size_t body_start = 0;
+    std::vector<size_t> frame_holes; // slot offsets that must be moved past the value stack once its depth is known
+
+    template <size_t N>
+    size_t place(const uint8_t (&stencil)[N]) {
+        size_t at = code.size();
+        code.insert(code.end(), stencil, stencil + N);
+        return at;
+    }
+
+    template <class T>
+    void patch(size_t at, T value) {
+        memcpy(&code[at], &value, sizeof(value));
+    }
+
+    void patchRelative(size_t hole, size_t target) {
+        patch<int32_t>(hole, int32_t(target - (hole + 4)));
+    }
+
+    static uint32_t slotOffset(unsigned slot) { return slot * 8; }
+
+    void emitSpill(unsigned slot) {
+        patch<uint32_t>(place(stencil::kSpill) + stencil::kSpillSlot, slotOffset(slot));
+        max_slots = std::max(max_slots, slot + 1);
+    }
+
+    // emit - code leaving e's value in xmm0, using value-stack slots from depth up.
+    void emit(const ExprAST &e, unsigned depth) {
+        switch (e.getKind()) {
+            case ExprKind::number:
+                patch(place(stencil::kLiteral) + stencil::kLiteralValue, toSessionPrecision(static_cast<const NumberExprAST &>(e).getVal()));
+                return;
+            case ExprKind::variable:
+                patch<uint32_t>(place(stencil::kArgument) + stencil::kArgumentOffset,
+                                static_cast<const VariableExprAST &>(e).getIndex() * 8);
+                return;
+            case ExprKind::binary: {
+                auto &bin = static_cast<const BinaryExprAST &>(e);
+                const ExprAST &rhs = bin.getRHS();
+                emit(bin.getLHS(), depth);
+                if (rhs.getKind() == ExprKind::number) {
+                    patch(place(stencil::kLiteralRight) + stencil::kLiteralRightValue,
+                          toSessionPrecision(static_cast<const NumberExprAST &>(rhs).getVal()));
+                }
+                else if (rhs.getKind() == ExprKind::variable) {
+                    patch<uint32_t>(place(stencil::kArgumentRight) + stencil::kArgumentRightOffset,
+                                    static_cast<const VariableExprAST &>(rhs).getIndex() * 8);
+                }
+                else {
+                    emitSpill(depth);
+                    emit(rhs, depth + 1);
+                    patch<uint32_t>(place(stencil::kReloadLeft) + stencil::kReloadLeftSlot, slotOffset(depth));
+                }
+                switch (bin.getOp()) {
+                    case '+': place(stencil::kAdd); break;
+                    case '-': place(stencil::kSub); break;
+                    case '*': place(stencil::kMul); break;
+                    case '<': place(stencil::kLess); return;
+                    default: emitCall(nullptr, 0, depth); return; // jitCall reports the invalid operator
+                }
+                if (single_precision)
+                    place(stencil::kRoundToSingle);
+                return;
+            }
+            case ExprKind::call: {
+                auto &call = static_cast<const CallExprAST &>(e);
+                unsigned nargs = call.getArgs().size();
+                for (unsigned i = 0; i != nargs; ++i) {
+                    emit(*call.getArgs()[i], depth + i);
+                    emitSpill(depth + i);
+                }
+                // a self tail call jumps back into this code, as long as it is still what the target runs.
+                const FunctionEntry *target = call.getTarget();
+                if (call.isTailCall() && nargs == target->arity && target->def && target->def->jit.get() == this) {
+                    // the frame area lies past the value stack, whose final depth is not known yet.
+                    for (unsigned i = 0; i != nargs; ++i) {
+                        size_t at = place(stencil::kCopySlot);
+                        patch<uint32_t>(at + stencil::kCopySlotFrom, slotOffset(depth + i));
+                        patch<uint32_t>(at + stencil::kCopySlotTo, slotOffset(i));
+                        frame_holes.push_back(at + stencil::kCopySlotTo);
+                    }
+                    size_t at = place(stencil::kRebaseArguments);
+                    patch<uint32_t>(at + stencil::kRebaseArgumentsFrame, 0);
+                    frame_holes.push_back(at + stencil::kRebaseArgumentsFrame);
+                    patchRelative(place(stencil::kJump) + stencil::kJumpTarget, body_start);
+                    tail_frame = std::max(tail_frame, nargs);
+                    return;
+                }
+                emitCall(call.getTarget(), nargs, depth);
+                return;
+            }
+            case ExprKind::conditional: {
+                auto &cond = static_cast<const IfExprAST &>(e);
+                emit(cond.getCond(), depth);
+                size_t to_else = place(stencil::kBranchIfZero) + stencil::kBranchIfZeroTarget;
+                emit(cond.getThen(), depth);
+                size_t to_end = place(stencil::kJump) + stencil::kJumpTarget;
+                patchRelative(to_else, code.size());
+                emit(cond.getElse(), depth);
+                patchRelative(to_end, code.size());
+                return;
+            }
+        }
+    }
+
+    void emitCall(const FunctionEntry *target, unsigned nargs, unsigned depth) {
+        size_t at = place(stencil::kCall);
+        patch(at + stencil::kCallTarget, target);
+        patch<uint32_t>(at + stencil::kCallFrame, slotOffset(depth));
+        patch<uint32_t>(at + stencil::kCallNargs, nargs);
+        patch(at + stencil::kCallHelper, &jitCall);
+    }
+
+public:
+    JitFunction() = default;
+    JitFunction(const JitFunction &) = delete;
+    JitFunction &operator=(const JitFunction &) = delete;
+    ~JitFunction() {
+        if (mapping)
+            munmap(mapping, mapping_size);
+    }
+
+    // compileBody - replace the code with body's; keeps the buffer and the mapping for reuse.
+    // false if executable memory cannot be had.
+    bool compileBody(const ExprAST &body) {
+        code.clear();
+        frame_holes.clear();
+        max_slots = tail_frame = 0;
+        entry = nullptr;
+        size_t prologue = place(stencil::kPrologue);
+        body_start = code.size();
+        emit(body, 0);
+        size_t epilogue = place(stencil::kEpilogue);
+
+        // the stack frame: value slots, then the tail call frame; keeps rsp 16-byte aligned at calls.
+        for (size_t hole : frame_holes) {
+            uint32_t offset;
+            memcpy(&offset, &code[hole], sizeof(offset));
+            patch<uint32_t>(hole, offset + slotOffset(max_slots));
+        }
+        uint32_t frame = (slotOffset(max_slots + tail_frame) + 15) / 16 * 16 + 8;
+        patch<uint32_t>(prologue + stencil::kPrologueFrame, frame);
+        patch<uint32_t>(epilogue + stencil::kEpilogueFrame, frame);
+
+        if (code.size() > mapping_size) {
+            if (mapping)
+                munmap(mapping, mapping_size);
+            size_t page = sysconf(_SC_PAGESIZE);
+            mapping_size = (code.size() + page - 1) / page * page;
+            mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                mapping_size = 0;
+                return false;
+            }
+        }
+        else if (mprotect(mapping, mapping_size, PROT_READ | PROT_WRITE) != 0)
+            return false;
+        memcpy(mapping, code.data(), code.size());
+        if (mprotect(mapping, mapping_size, PROT_READ | PROT_EXEC) != 0)
+            return false;
+        entry = reinterpret_cast<double (*)(const double *)>(mapping);
+        return true;
+    }
+
+    bool compiled() const { return entry != nullptr; }
+    size_t codeSize() const { return code.size(); }
+    double run(const double *args) const { return entry(args); }
+};
+
+static double jitCall(const FunctionEntry *target, const double *frame, unsigned nargs) {
+    if (!target)
+        return logErrorEval("invalid binary operator");
+    if (nargs != target->arity)
+        return logErrorEval("Incorrect # arguments passed");
+    if (target->native)
+        return toSessionPrecision(target->native(frame));
+    if (!target->def)
+        return logErrorEval("call to an extern without a native implementation");
+    if (target->def->jit && target->def->jit->compiled())
+        return target->def->jit->run(frame);
+    return target->def->eval(frame);
+}
+#else
+// JitFunction - without x86-64 Linux there is nothing to compile to; --engine jit is refused.
+class JitFunction {
+public:
+    bool compileBody(const ExprAST &body) { return false; }
+    bool compiled() const { return false; }
+    size_t codeSize() const { return 0; }
+    double run(const double *args) const { return 0; }
+};
+#endif
+
+FunctionAST::~FunctionAST() = default;
+
+//---------------------------------------------------------------------
+// Engine Selection
+//---------------------------------------------------------------------
+
+// Engine - how top-level expressions (and the functions they call) are evaluated.
+enum class Engine { tree, linear, closure, jit };
+static Engine engine = Engine::tree;
+static unsigned bench_iterations = 0; // --bench-engines; 0 disables the benchmark
+
+// prepareFunction - build whatever the engine runs for a new definition, unless a shared body already has it.
+static void prepareFunction(FunctionAST &fn) {
+    if ((engine == Engine::linear || bench_iterations) && !fn.linear) {
+        fn.linear = std::make_unique<LinearFunction>();
+        fn.linear->linearize(fn.getBody());
+    }
+    if ((engine == Engine::closure || bench_iterations) && !fn.closure) {
+        fn.closure = std::make_unique<ClosureFunction>();
+        fn.closure->compileBody(fn.getBody());
+    }
+    if ((engine == Engine::jit || bench_iterations) && !fn.jit) {
+        fn.jit = std::make_unique<JitFunction>();
+        fn.jit->compileBody(fn.getBody());
+    }
+}
+
+// reprepareFunction - fn's body was rewritten in place: rebuild what the engine runs from it.
+static void reprepareFunction(FunctionAST &fn) {
+    fn.linear.reset();
+    fn.closure.reset();
+    fn.jit.reset();
+    prepareFunction(fn);
+}
+
+// evaluateTopLevel - evaluate an anonymous top-level function with the selected engine.
+// Its linear or compiled form goes into a buffer reused across items, so this does not allocate either.
+static double evaluateTopLevel(const FunctionAST &fn) {
+    if (engine == Engine::linear) {
+        static LinearFunction top_level;
+        top_level.linearize(fn.getBody());
+        return top_level.run(nullptr);
+    }
+    if (engine == Engine::closure) {
+        static ClosureFunction top_level;
+        top_level.compileBody(fn.getBody());
+        return top_level.run(nullptr);
+    }
+    if (engine == Engine::jit) {
+        static JitFunction top_level;
+        if (top_level.compileBody(fn.getBody()))
+            return top_level.run(nullptr);
+    }
+    return fn.eval(nullptr);
+}
+
+// PrecisionReport - how far single-precision results fall from double precision.
+static struct {
+    uint64_t compared = 0;
+    double max_abs_error = 0, max_rel_error = 0, sum_rel_error = 0;
+} PrecisionReport;
+
+// comparePrecision - evaluate pure fn again in double precision, with the tree engine, and record how
+// far result, its single-precision value, is from that.
+static void comparePrecision(const FunctionAST &fn, double result) {
+    single_precision = false;
+    const char *saved_error = eval_error;
+    double reference = fn.eval(nullptr);
+    eval_error = saved_error;
+    single_precision = true;
+    if (!std::isfinite(reference) || !std::isfinite(result))
+        return;
+    double abs_error = std::fabs(result - reference);
+    double rel_error = reference != 0.0 ? abs_error / std::fabs(reference) : abs_error;
+    ++PrecisionReport.compared;
+    PrecisionReport.max_abs_error = std::max(PrecisionReport.max_abs_error, abs_error);
+    PrecisionReport.max_rel_error = std::max(PrecisionReport.max_rel_error, rel_error);
+    PrecisionReport.sum_rel_error += rel_error;
+}
+
+// CacheMissCounter - L1 data-cache read misses of the calling thread, where perf events are permitted.
+class CacheMissCounter {
+    int fd = -1;
+
+public:
+    CacheMissCounter() {
+#ifdef KALEIDOSCOPE_HAVE_PERF
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~CacheMissCounter() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+#ifdef KALEIDOSCOPE_HAVE_PERF
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    uint64_t stop() {
+        uint64_t count = 0;
+#ifdef KALEIDOSCOPE_HAVE_PERF
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (::read(fd, &count, sizeof(count)) != sizeof(count))
+                count = 0;
+        }
+#endif
+        return count;
+    }
+};
+
+// benchmarkEngines - evaluate fn bench_iterations times with each engine and print the time and
+// L1 data-cache misses per evaluated node, and what compiling fn's body took for the engines that do.
+// Nodes are counted as linear ops executed, callees included.
+static void benchmarkEngines(const FunctionAST &fn) {
+    LinearFunction linear;
+    auto linear_start = Clock::now();
+    linear.linearize(fn.getBody());
+    uint64_t linear_ns = nanosSince(linear_start);
+    ClosureFunction closure;
+    auto closure_start = Clock::now();
+    closure.compileBody(fn.getBody());
+    uint64_t closure_ns = nanosSince(closure_start);
+    JitFunction jit;
+    auto jit_start = Clock::now();
+    bool jit_compiled = jit.compileBody(fn.getBody());
+    uint64_t jit_ns = nanosSince(jit_start);
+    uint64_t nodes = 0;
+    eval_error = nullptr;
+    linear.run<true>(nullptr, &nodes);
+    if (eval_error)
+        return;
+    nodes *= bench_iterations;
+
+    CacheMissCounter misses;
+    volatile double sink;
+    for (Engine bench_engine : {Engine::tree, Engine::linear, Engine::closure, Engine::jit}) {
+        if (bench_engine == Engine::jit && !jit_compiled)
+            continue;
+        misses.start();
+        auto start = Clock::now();
+        for (unsigned i = 0; i != bench_iterations; ++i) {
+            switch (bench_engine) {
+                case Engine::tree: sink = fn.eval(nullptr); break;
+                case Engine::linear: sink = linear.run(nullptr); break;
+                case Engine::closure: sink = closure.run(nullptr); break;
+                case Engine::jit: sink = jit.run(nullptr); break;
+            }
+        }
+        uint64_t ns = nanosSince(start);
+        uint64_t miss_count = misses.stop();
+
+        char miss_text[32] = "n/a";
+        if (misses.available())
+            snprintf(miss_text, sizeof(miss_text), "%.4f", double(miss_count) / nodes);
+        static const char *const kEngineNames[] = {"tree", "linear", "closure", "jit"};
+        fprintf(stderr, "bench %-7s %8.2f ns/node  %s L1d misses/node\n", kEngineNames[(int)bench_engine],
+                double(ns) / nodes, miss_text);
+    }
+    fprintf(stderr, "bench compile: linear %llu ns, closure %llu ns, jit %llu ns (%zu bytes)\n", (unsigned long long)linear_ns,
+            (unsigned long long)closure_ns, (unsigned long long)jit_ns, jit.codeSize());
+    (void)sink;
+}
+
+// NativeFunctions - library functions an 'extern' can bind to.
+static double nativeSin(const double *args) { return sin(args[0]); }
+static double nativeCos(const double *args) { return cos(args[0]); }
+static double nativeExp(const double *args) { return exp(args[0]); }
+static double nativeLog(const double *args) { return log(args[0]); }
+static double nativePow(const double *args) { return pow(args[0], args[1]); }
+static double nativeSqrt(const double *args) { return sqrt(args[0]); }
+static double nativePutchard(const double *args) {
+    fputc((char)args[0], stderr);
+    return 0;
+}
+static double nativePrintd(const double *args) {
+    fprintf(stderr, "%f\n", args[0]);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    unsigned arity;
+    double (*fn)(const double *args);
+    bool pure;
+} NativeFunctions[] = {
+    {"sin", 1, nativeSin, true},   {"cos", 1, nativeCos, true},   {"exp", 1, nativeExp, true},
+    {"log", 1, nativeLog, true},   {"pow", 2, nativePow, true},   {"sqrt", 1, nativeSqrt, true},
+    {"putchard", 1, nativePutchard, false}, {"printd", 1, nativePrintd, false},
+};
+
+//---------------------------------------------------------------------
+// Result Cache
+//---------------------------------------------------------------------
+
+// ResultCache - results of pure top-level expressions, keyed on their structural hash, so an
+// expression seen before, however it was formatted, is answered without evaluating it again.
+static std::unordered_map<uint64_t, double> ResultCache;
+static size_t result_cache_capacity = 0; // 0 disables the cache
+
+/*
+refreshFunctionHashes - a function was redefined: every definition reaching it now has a stale
+hash and purity. Recompute them until nothing changes; purity only ever drops, and a cycle of
+redefined functions stops after one round per function. Cached results and cost estimates may
+depend on the old definition, so they are dropped as well.
+*/
+static void refreshFunctionHashes() {
+    ResultCache.clear();
+    for (auto &named : FunctionTable)
+        named.second.cost_known = false;
+    for (size_t round = 0; round <= FunctionTable.size(); ++round) {
+        bool changed = false;
+        for (auto &named : FunctionTable) {
+            FunctionEntry &entry = named.second;
+            if (!entry.def)
+                continue;
+            entry.def->rehash();
+            uint64_t hash = entry.def->getHash();
+            bool pure = entry.def->getBody().isPure();
+            changed = changed || hash != entry.hash || pure != entry.pure;
+            entry.hash = hash;
+            entry.pure = pure;
+        }
+        if (!changed)
+            return;
+    }
+}
+
+//---------------------------------------------------------------------
+// Deduplication
+//---------------------------------------------------------------------
+
+/*
+Generated code is full of definitions that differ only in their names and parameter names. With
+variables resolved to positional slots and hashed that way, such functions have equal hashes;
+dedupDefinition() confirms a hash match node by node and then makes the new function an alias:
+its entry shares the existing FunctionAST and the new body is freed. Later engines compile each
+shared body once.
+*/
+static bool dedup_enabled = false;
+static unsigned dedup_definitions = 0, dedup_merged = 0;
+static std::unordered_multimap<uint64_t, FunctionEntry *> DefinitionsByHash;
+
+// structurallyEqual - a and b are the same tree up to parameter names. Calls must name the same entry:
+// two entries sharing a body today may be redefined apart tomorrow. For the same reason self calls
+// are never equal: after a merge they would call whatever their original name is redefined to.
+static bool structurallyEqual(const ExprAST &a, const ExprAST &b) {
+    if (a.getKind() != b.getKind() || a.getHash() != b.getHash())
+        return false;
+    switch (a.getKind()) {
+        case ExprKind::number: {
+            double x = static_cast<const NumberExprAST &>(a).getVal(), y = static_cast<const NumberExprAST &>(b).getVal();
+            return memcmp(&x, &y, sizeof(x)) == 0;
+        }
+        case ExprKind::variable:
+            return static_cast<const VariableExprAST &>(a).getIndex() == static_cast<const VariableExprAST &>(b).getIndex();
+        case ExprKind::binary: {
+            auto &x = static_cast<const BinaryExprAST &>(a), &y = static_cast<const BinaryExprAST &>(b);
+            return x.getOp() == y.getOp() && structurallyEqual(x.getLHS(), y.getLHS()) && structurallyEqual(x.getRHS(), y.getRHS());
+        }
+        case ExprKind::call: {
+            auto &x = static_cast<const CallExprAST &>(a), &y = static_cast<const CallExprAST &>(b);
+            if (x.isSelfCall() || y.isSelfCall() || x.getTarget() != y.getTarget() || x.getArgs().size() != y.getArgs().size())
+                return false;
+            for (size_t i = 0; i != x.getArgs().size(); ++i)
+                if (!structurallyEqual(*x.getArgs()[i], *y.getArgs()[i]))
+                    return false;
+            return true;
+        }
+        case ExprKind::conditional: {
+            auto &x = static_cast<const IfExprAST &>(a), &y = static_cast<const IfExprAST &>(b);
+            return structurallyEqual(x.getCond(), y.getCond()) && structurallyEqual(x.getThen(), y.getThen()) && structurallyEqual(x.getElse(), y.getElse());
+        }
+    }
+    return false;
+}
+
+// dedupDefinition - share an existing alpha-equivalent body with entry, if there is one.
+static void dedupDefinition(FunctionEntry &entry) {
+    ++dedup_definitions;
+    auto range = DefinitionsByHash.equal_range(entry.hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        FunctionEntry &other = *it->second;
+        // the index is never pruned, so skip entries that have been redefined since.
+        if (&other == &entry || other.hash != entry.hash || !other.def || other.def->getProto().getArgs().size() != entry.arity)
+            continue;
+        if (structurallyEqual(other.def->getBody(), entry.def->getBody())) {
+            entry.def = other.def;
+            ++dedup_merged;
+            return;
+        }
+    }
+    DefinitionsByHash.emplace(entry.hash, &entry);
+}
+
+//---------------------------------------------------------------------
+// Interprocedural Constant Propagation
+//---------------------------------------------------------------------
+
+/*
+Library helpers are often called with the same literal for some parameter from every call site.
+With --ipcp, the calls between definitions are scanned before each top-level expression that
+follows new definitions. When every such call site of a function passes one constant for a
+parameter, the function gets a specialization: a copy of its body with that constant substituted
+and constant-folded, installed as a new function ("name.N") without the parameter, and those call
+sites are rewritten to call it. A session is never complete, so the original stays as it was and
+calls from top-level expressions, or from later definitions passing other values, still reach it;
+a rewritten call site computes exactly what it did before, whatever is defined later. For the
+same reason the original's own calls keep their parameters, so a constant reaches one level of
+helpers per specialization rather than flowing down whole chains.
+
+When the original is redefined or redeclared, its specializations are rebuilt from the new
+definition, or turned into thunks calling it with the constants when that is not possible.
+*/
+static bool ipcp_enabled = false;
+static bool ipcp_pending = false; // definitions changed since the last run
+static unsigned ipcp_call_sites = 0;
+
+// Specialization - origin with the parameters marked in fixed bound to values, installed as name.
+struct Specialization {
+    std::string origin_name;
+    const FunctionEntry *origin;
+    std::vector<bool> fixed;
+    std::vector<double> values;
+    std::string name;
+    FunctionEntry *entry;
+};
+static std::deque<Specialization> Specializations; // a deque never moves its elements
+
+static bool sameConstant(double a, double b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// foldConstants - replace operators and pure native calls on literals by their value.
+// every node whose children changed is rehashed on the way back up, so the Merkle hashes stay valid.
+static void foldConstants(std::unique_ptr<ExprAST> &e) {
+    bool foldable = false;
+    if (e->getKind() == ExprKind::binary) {
+        auto &bin = static_cast<BinaryExprAST &>(*e);
+        foldConstants(bin.mutableLHS());
+        foldConstants(bin.mutableRHS());
+        bin.updateHash();
+        foldable = bin.getLHS().getKind() == ExprKind::number && bin.getRHS().getKind() == ExprKind::number;
+    }
+    else if (e->getKind() == ExprKind::call) {
+        auto &call = static_cast<CallExprAST &>(*e);
+        foldable = call.getTarget()->native && call.getTarget()->pure && call.getArgs().size() == call.getTarget()->arity;
+        for (auto &arg : call.mutableArgs()) {
+            foldConstants(arg);
+            foldable = foldable && arg->getKind() == ExprKind::number;
+        }
+        call.updateHash();
+    }
+    else if (e->getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(*e);
+        foldConstants(cond.mutableCond());
+        foldConstants(cond.mutableThen());
+        foldConstants(cond.mutableElse());
+        cond.updateHash();
+        if (cond.getCond().getKind() == ExprKind::number) {
+            // only the branch taken is left.
+            bool taken = cond.getCond().eval(nullptr) != 0.0;
+            e = std::move(taken ? cond.mutableThen() : cond.mutableElse());
+        }
+    }
+    if (foldable)
+        e = std::make_unique<NumberExprAST>(e->eval(nullptr));
+}
+
+// substituteFixed - a copy of e with spec's fixed parameters replaced by their values and the others renumbered.
+// calls that were self calls now call the origin by entry: in the copy, "self" would mean the specialization.
+// retargetSelfCalls() turns back those that pass the specialization's own constants.
+static std::unique_ptr<ExprAST> substituteFixed(const ExprAST &e, const Specialization &spec, const std::vector<unsigned> &slots) {
+    switch (e.getKind()) {
+        case ExprKind::number:
+            return e.clone();
+        case ExprKind::variable: {
+            auto &var = static_cast<const VariableExprAST &>(e);
+            if (spec.fixed[var.getIndex()])
+                return std::make_unique<NumberExprAST>(spec.values[var.getIndex()]);
+            return std::make_unique<VariableExprAST>(var.getName(), slots[var.getIndex()]);
+        }
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            return std::make_unique<BinaryExprAST>(bin.getOp(), substituteFixed(bin.getLHS(), spec, slots), substituteFixed(bin.getRHS(), spec, slots));
+        }
+        case ExprKind::call: {
+            auto &call = static_cast<const CallExprAST &>(e);
+            std::vector<std::unique_ptr<ExprAST>> args;
+            for (const auto &arg : call.getArgs())
+                args.push_back(substituteFixed(*arg, spec, slots));
+            return std::make_unique<CallExprAST>(call.getCallee(), std::move(args), call.getTarget(), false);
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<const IfExprAST &>(e);
+            return std::make_unique<IfExprAST>(substituteFixed(cond.getCond(), spec, slots), substituteFixed(cond.getThen(), spec, slots),
+                                               substituteFixed(cond.getElse(), spec, slots));
+        }
+    }
+    return nullptr;
+}
+
+static void markTailCalls(ExprAST &e);
+
+// passesConstants - whether call passes exactly spec's constants for its fixed parameters.
+static bool passesConstants(const CallExprAST &call, const Specialization &spec) {
+    if (call.getArgs().size() != spec.fixed.size())
+        return false;
+    for (size_t i = 0; i != spec.fixed.size(); ++i) {
+        const ExprAST &arg = *call.getArgs()[i];
+        if (spec.fixed[i] && (arg.getKind() != ExprKind::number || !sameConstant(static_cast<const NumberExprAST &>(arg).getVal(), spec.values[i])))
+            return false;
+    }
+    return true;
+}
+
+// retargetSelfCalls - make the calls of spec's origin in e that pass spec's constants self calls of spec,
+// so recursion stays in the specialization and a tail call still loops. Hashes are updated on the way up.
+static void retargetSelfCalls(std::unique_ptr<ExprAST> &e, const Specialization &spec) {
+    if (e->getKind() == ExprKind::binary) {
+        auto &bin = static_cast<BinaryExprAST &>(*e);
+        retargetSelfCalls(bin.mutableLHS(), spec);
+        retargetSelfCalls(bin.mutableRHS(), spec);
+        bin.updateHash();
+    }
+    else if (e->getKind() == ExprKind::call) {
+        auto &call = static_cast<CallExprAST &>(*e);
+        for (auto &arg : call.mutableArgs())
+            retargetSelfCalls(arg, spec);
+        call.updateHash();
+        if (call.getTarget() != spec.origin || !passesConstants(call, spec))
+            return;
+        std::vector<std::unique_ptr<ExprAST>> args;
+        for (size_t i = 0; i != spec.fixed.size(); ++i)
+            if (!spec.fixed[i])
+                args.push_back(std::move(call.mutableArgs()[i]));
+        e = std::make_unique<CallExprAST>(spec.name, std::move(args), spec.entry, true);
+    }
+    else if (e->getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(*e);
+        retargetSelfCalls(cond.mutableCond(), spec);
+        retargetSelfCalls(cond.mutableThen(), spec);
+        retargetSelfCalls(cond.mutableElse(), spec);
+        cond.updateHash();
+    }
+}
+
+// installSpecialization - (re)build spec's body from its origin's current definition.
+static void installSpecialization(const Specialization &spec) {
+    std::vector<std::string> params;
+    std::vector<unsigned> slots(spec.fixed.size());
+    for (unsigned i = 0; i != spec.fixed.size(); ++i) {
+        slots[i] = params.size();
+        if (!spec.fixed[i])
+            params.push_back(spec.origin->def && spec.origin->arity == spec.fixed.size() ? spec.origin->def->getProto().getArgs()[i] : "p" + std::to_string(i));
+    }
+
+    std::unique_ptr<ExprAST> body;
+    if (spec.origin->def && spec.origin->arity == spec.fixed.size()) {
+        body = substituteFixed(spec.origin->def->getBody(), spec, slots);
+        foldConstants(body);
+        retargetSelfCalls(body, spec);
+        markTailCalls(*body);
+    }
+    else {
+        // thunk: call the origin with the constants put back, so it fails or succeeds just as the original call would.
+        std::vector<std::unique_ptr<ExprAST>> args;
+        for (unsigned i = 0; i != spec.fixed.size(); ++i) {
+            if (spec.fixed[i])
+                args.push_back(std::make_unique<NumberExprAST>(spec.values[i]));
+            else
+                args.push_back(std::make_unique<VariableExprAST>(params[slots[i]], slots[i]));
+        }
+        body = std::make_unique<CallExprAST>(spec.origin_name, std::move(args), spec.origin, false);
+    }
+
+    FunctionEntry &entry = *spec.entry;
+    entry.def = std::make_shared<FunctionAST>(std::make_unique<PrototypeAST>(spec.name, params), std::move(body));
+    entry.native = nullptr;
+    entry.arity = params.size();
+    entry.declared = true;
+    entry.hash = entry.def->getHash();
+    entry.pure = entry.def->getBody().isPure();
+    prepareFunction(*entry.def);
+}
+
+// rebuildSpecializations - origin was redefined or redeclared.
+static void rebuildSpecializations(const FunctionEntry &origin) {
+    for (const Specialization &spec : Specializations)
+        if (spec.origin == &origin)
+            installSpecialization(spec);
+}
+
+// findSpecialization - the specialization of origin binding exactly these constants, created if needed.
+static const Specialization &findSpecialization(const std::string &origin_name, const FunctionEntry *origin, const std::vector<bool> &fixed, const std::vector<double> &values) {
+    for (const Specialization &spec : Specializations) {
+        if (spec.origin != origin || spec.fixed != fixed)
+            continue;
+        bool same = true;
+        for (size_t i = 0; i != fixed.size(); ++i)
+            same = same && (!fixed[i] || sameConstant(spec.values[i], values[i]));
+        if (same)
+            return spec;
+    }
+    std::string name = origin_name + "." + std::to_string(Specializations.size() + 1);
+    Specializations.push_back({origin_name, origin, fixed, values, name, &FunctionTable[name]});
+    installSpecialization(Specializations.back());
+    return Specializations.back();
+}
+
+// ParamFact - what the call sites seen so far pass for one parameter.
+struct ParamFact {
+    bool constant = true;
+    double value = 0;
+    bool seen = false;
+};
+
+// CallSiteFacts - what all call sites of one function pass.
+struct CallSiteFacts {
+    std::string name;
+    std::vector<ParamFact> params;
+};
+
+// forEachCallSite - every call in the definitions, each shared body once, with the definition it
+// is in; fn may replace the call.
+template <typename Fn>
+static void forEachCallSite(std::unique_ptr<ExprAST> &e, FunctionAST &owner, Fn &fn) {
+    if (e->getKind() == ExprKind::binary) {
+        auto &bin = static_cast<BinaryExprAST &>(*e);
+        forEachCallSite(bin.mutableLHS(), owner, fn);
+        forEachCallSite(bin.mutableRHS(), owner, fn);
+    }
+    else if (e->getKind() == ExprKind::call) {
+        for (auto &arg : static_cast<CallExprAST &>(*e).mutableArgs())
+            forEachCallSite(arg, owner, fn);
+        fn(e, owner);
+    }
+    else if (e->getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(*e);
+        forEachCallSite(cond.mutableCond(), owner, fn);
+        forEachCallSite(cond.mutableThen(), owner, fn);
+        forEachCallSite(cond.mutableElse(), owner, fn);
+    }
+}
+
+template <typename Fn>
+static void forEachCallSite(Fn fn) {
+    std::vector<const FunctionAST *> visited;
+    std::vector<FunctionAST *> defs;
+    for (auto &named : FunctionTable) {
+        FunctionAST *def = named.second.def.get();
+        if (def && std::find(visited.begin(), visited.end(), def) == visited.end()) {
+            visited.push_back(def);
+            defs.push_back(def);
+        }
+    }
+    for (FunctionAST *def : defs)
+        forEachCallSite(def->mutableBody(), *def, fn);
+}
+
+// propagateConstants - specialize every function whose call sites in definitions agree on some constant.
+// a function's calls of itself are not call sites: the original keeps them, and its specializations
+// turn those passing their constants into self calls of their own.
+static void propagateConstants() {
+    ipcp_pending = false;
+    std::map<const FunctionEntry *, CallSiteFacts> facts;
+    forEachCallSite([&](std::unique_ptr<ExprAST> &e, FunctionAST &owner) {
+        auto &call = static_cast<CallExprAST &>(*e);
+        const FunctionEntry *target = call.getTarget();
+        if (!target->def || target->def.get() == &owner || call.getArgs().size() != target->arity)
+            return;
+        CallSiteFacts &sites = facts[target];
+        sites.name = call.getCallee();
+        sites.params.resize(target->arity);
+        for (size_t i = 0; i != sites.params.size(); ++i) {
+            ParamFact &param = sites.params[i];
+            const ExprAST &arg = *call.getArgs()[i];
+            double value = arg.getKind() == ExprKind::number ? static_cast<const NumberExprAST &>(arg).getVal() : 0;
+            if (arg.getKind() != ExprKind::number || (param.seen && !sameConstant(param.value, value)))
+                param.constant = false;
+            param.value = value;
+            param.seen = true;
+        }
+    });
+
+    std::map<const FunctionEntry *, const Specialization *> chosen;
+    for (auto &target : facts) {
+        std::vector<bool> fixed;
+        std::vector<double> values;
+        for (const ParamFact &param : target.second.params) {
+            fixed.push_back(param.constant);
+            values.push_back(param.value);
+        }
+        if (std::find(fixed.begin(), fixed.end(), true) != fixed.end())
+            chosen[target.first] = &findSpecialization(target.second.name, target.first, fixed, values);
+    }
+    if (chosen.empty())
+        return;
+
+    std::vector<FunctionAST *> rewritten;
+    forEachCallSite([&](std::unique_ptr<ExprAST> &e, FunctionAST &owner) {
+        auto &call = static_cast<CallExprAST &>(*e);
+        auto it = chosen.find(call.getTarget());
+        if (it == chosen.end() || call.getTarget()->def.get() == &owner || !passesConstants(call, *it->second))
+            return;
+        const Specialization &spec = *it->second;
+        std::vector<std::unique_ptr<ExprAST>> args;
+        for (size_t i = 0; i != spec.fixed.size(); ++i)
+            if (!spec.fixed[i])
+                args.push_back(std::move(call.mutableArgs()[i]));
+        e = std::make_unique<CallExprAST>(spec.name, std::move(args), spec.entry, false);
+        ++ipcp_call_sites;
+        if (std::find(rewritten.begin(), rewritten.end(), &owner) == rewritten.end())
+            rewritten.push_back(&owner);
+    });
+    // the callers' linear, closure and jit forms still call the originals.
+    for (FunctionAST *def : rewritten)
+        reprepareFunction(*def);
+    refreshFunctionHashes();
+}
+
+//---------------------------------------------------------------------
+// Automatic Differentiation
+//---------------------------------------------------------------------
+
+/*
+'derive dfdx f(x)' defines dfdx(...), taking f's parameters, as the partial derivative of f with
+respect to x; listing several parameters gives the sum of their partials, i.e. the derivative
+along that diagonal. Derivatives are exact, by forward-mode differentiation of the body: every
+subexpression e gets a tangent expression e' by the dual-number rules
+    (a + b)' = a' + b'    (a - b)' = a' - b'    (a * b)' = a'*b + a*b'    (a < b)' = 0
+    (if c then a else b)' = if c then a' else b'
+    g(a1..an)' = sum of g_i(a1..an) * ai'
+where g_i is g's partial with respect to its i-th parameter: for sin, cos, exp, log, sqrt and pow
+a closed form, for a definition a generated function "g.di" of the same parameters. Tangents known
+to be zero are dropped, so a partial costs about one evaluation of the function. Partials are made
+once per function and parameter, and rebuilt when the function is redefined. Calls with side
+effects cannot be differentiated.
+*/
+// Derivative - the partial derivative of origin with respect to parameter param, installed as name.
+struct Derivative {
+    std::string origin_name;
+    const FunctionEntry *origin;
+    unsigned param;
+    std::string name;
+    FunctionEntry *entry;
+    bool building;
+};
+static std::deque<Derivative> Derivatives;
+static const FunctionEntry *derivative_being_built = nullptr; // its calls to itself are self calls
+
+static FunctionEntry *partialEntry(const std::string &origin_name, const FunctionEntry *origin, unsigned param);
+
+// nativeCall - a call of the named native, through an entry of its own so no extern is needed.
+static std::unique_ptr<ExprAST> nativeCall(const char *name, std::vector<std::unique_ptr<ExprAST>> args) {
+    std::string entry_name = std::string(name) + ".native";
+    FunctionEntry &entry = FunctionTable[entry_name];
+    if (!entry.declared) {
+        for (const auto &native : NativeFunctions) {
+            if (strcmp(native.name, name) == 0) {
+                entry.native = native.fn;
+                entry.arity = native.arity;
+                entry.pure = native.pure;
+            }
+        }
+        entry.declared = true;
+        entry.hash = hashCombine(hashString(name), hashCombine(0x70726f746full, entry.arity));
+    }
+    return std::make_unique<CallExprAST>(entry_name, std::move(args), &entry, false);
+}
+
+static std::unique_ptr<ExprAST> nativeCall(const char *name, std::unique_ptr<ExprAST> arg) {
+    std::vector<std::unique_ptr<ExprAST>> args;
+    args.push_back(std::move(arg));
+    return nativeCall(name, std::move(args));
+}
+
+static std::unique_ptr<ExprAST> nativeCall(const char *name, std::unique_ptr<ExprAST> a, std::unique_ptr<ExprAST> b) {
+    std::vector<std::unique_ptr<ExprAST>> args;
+    args.push_back(std::move(a));
+    args.push_back(std::move(b));
+    return nativeCall(name, std::move(args));
+}
+
+static std::unique_ptr<ExprAST> number(double val) {
+    return std::make_unique<NumberExprAST>(val);
+}
+
+static std::unique_ptr<ExprAST> binary(char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) {
+    return std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+}
+
+// partialCall - target's partial with respect to parameter i at args; null if it has none.
+static std::unique_ptr<ExprAST> partialCall(const std::string &name, const FunctionEntry *target,
+                                            const std::vector<std::unique_ptr<ExprAST>> &args, unsigned i) {
+    if (args.size() != target->arity || !target->pure)
+        return nullptr;
+    if (target->def) {
+        FunctionEntry *partial = partialEntry(name, target, i);
+        if (!partial)
+            return nullptr;
+        std::vector<std::unique_ptr<ExprAST>> copies;
+        for (const auto &arg : args)
+            copies.push_back(arg->clone());
+        return std::make_unique<CallExprAST>(name + ".d" + std::to_string(i), std::move(copies), partial, partial == derivative_being_built);
+    }
+    const char *native = nullptr;
+    for (const auto &entry : NativeFunctions)
+        if (target->native == entry.fn)
+            native = entry.name;
+    if (!native)
+        return nullptr;
+    std::string fn = native;
+    if (fn == "sin")
+        return nativeCall("cos", args[0]->clone());
+    if (fn == "cos")
+        return binary('-', number(0), nativeCall("sin", args[0]->clone()));
+    if (fn == "exp")
+        return nativeCall("exp", args[0]->clone());
+    if (fn == "log")
+        return nativeCall("pow", args[0]->clone(), number(-1));
+    if (fn == "sqrt")
+        return binary('*', number(0.5), nativeCall("pow", args[0]->clone(), number(-0.5)));
+    if (fn == "pow" && i == 0)
+        return binary('*', args[1]->clone(), nativeCall("pow", args[0]->clone(), binary('-', args[1]->clone(), number(1))));
+    if (fn == "pow")
+        return binary('*', nativeCall("pow", args[0]->clone(), args[1]->clone()), nativeCall("log", args[0]->clone()));
+    return nullptr;
+}
+
+// addTangent / mulTangent - tangent arithmetic, where a null tangent is a known zero.
+static std::unique_ptr<ExprAST> addTangent(std::unique_ptr<ExprAST> a, std::unique_ptr<ExprAST> b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    return binary('+', std::move(a), std::move(b));
+}
+
+static std::unique_ptr<ExprAST> mulTangent(std::unique_ptr<ExprAST> value, std::unique_ptr<ExprAST> tangent) {
+    if (!tangent)
+        return nullptr;
+    if (tangent->getKind() == ExprKind::number && static_cast<const NumberExprAST &>(*tangent).getVal() == 1.0)
+        return value;
+    return binary('*', std::move(value), std::move(tangent));
+}
+
+// tangent - e' with parameter param seeded with 1; ok is cleared if e cannot be differentiated.
+static std::unique_ptr<ExprAST> tangent(const ExprAST &e, unsigned param, bool &ok) {
+    switch (e.getKind()) {
+        case ExprKind::number:
+            return nullptr;
+        case ExprKind::variable:
+            return static_cast<const VariableExprAST &>(e).getIndex() == param ? number(1) : nullptr;
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            auto lhs = tangent(bin.getLHS(), param, ok), rhs = tangent(bin.getRHS(), param, ok);
+            switch (bin.getOp()) {
+                case '+':
+                    return addTangent(std::move(lhs), std::move(rhs));
+                case '-':
+                    if (!rhs)
+                        return lhs;
+                    return binary('-', lhs ? std::move(lhs) : number(0), std::move(rhs));
+                case '*':
+                    return addTangent(mulTangent(bin.getRHS().clone(), std::move(lhs)), mulTangent(bin.getLHS().clone(), std::move(rhs)));
+                default:
+                    return nullptr;
+            }
+        }
+        case ExprKind::call: {
+            auto &call = static_cast<const CallExprAST &>(e);
+            std::unique_ptr<ExprAST> sum;
+            for (unsigned i = 0; i != call.getArgs().size(); ++i) {
+                auto arg = tangent(*call.getArgs()[i], param, ok);
+                if (!arg)
+                    continue;
+                auto partial = partialCall(call.getCallee(), call.getTarget(), call.getArgs(), i);
+                if (!partial) {
+                    ok = false;
+                    return nullptr;
+                }
+                sum = addTangent(std::move(sum), mulTangent(std::move(partial), std::move(arg)));
+            }
+            return sum;
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<const IfExprAST &>(e);
+            auto then_tangent = tangent(cond.getThen(), param, ok), else_tangent = tangent(cond.getElse(), param, ok);
+            if (!then_tangent && !else_tangent)
+                return nullptr;
+            return std::make_unique<IfExprAST>(cond.getCond().clone(), then_tangent ? std::move(then_tangent) : number(0),
+                                               else_tangent ? std::move(else_tangent) : number(0));
+        }
+    }
+    return nullptr;
+}
+
+// buildDerivative - (re)build d's function from its origin's current definition; false if it has none.
+static bool buildDerivative(Derivative &d) {
+    FunctionEntry &entry = *d.entry;
+    entry.def.reset();
+    entry.declared = false;
+    if (!d.origin->def || !d.origin->pure || d.param >= d.origin->arity)
+        return false;
+
+    d.building = true;
+    const FunctionEntry *outer = derivative_being_built;
+    derivative_being_built = &entry;
+    bool ok = true;
+    auto body = tangent(d.origin->def->getBody(), d.param, ok);
+    derivative_being_built = outer;
+    d.building = false;
+    if (!ok)
+        return false;
+
+    entry.def = std::make_shared<FunctionAST>(std::make_unique<PrototypeAST>(d.name, d.origin->def->getProto().getArgs()),
+                                              body ? std::move(body) : number(0));
+    entry.native = nullptr;
+    entry.arity = d.origin->arity;
+    entry.declared = true;
+    entry.hash = entry.def->getHash();
+    entry.pure = entry.def->getBody().isPure();
+    prepareFunction(*entry.def);
+    return true;
+}
+
+// partialEntry - the entry of origin's partial with respect to param, built if needed; null if it cannot be.
+static FunctionEntry *partialEntry(const std::string &origin_name, const FunctionEntry *origin, unsigned param) {
+    for (Derivative &d : Derivatives)
+        if (d.origin == origin && d.param == param)
+            return d.building || d.entry->declared ? d.entry : nullptr;
+    std::string name = origin_name + ".d" + std::to_string(param);
+    // building may push the partials of callees, so hold on to this one rather than to back().
+    Derivative &d = Derivatives.emplace_back(Derivative{origin_name, origin, param, name, &FunctionTable[name], false});
+    return buildDerivative(d) ? d.entry : nullptr;
+}
+
+// rebuildDerivatives - origin was redefined or redeclared.
+static void rebuildDerivatives(const FunctionEntry &origin) {
+    for (Derivative &d : Derivatives)
+        if (d.origin == &origin && !buildDerivative(d))
+            fprintf(stderr, "Error: '%s' can no longer be differentiated; calls to '%s' will fail\n", d.origin_name.c_str(), d.name.c_str());
+}
+
+// deriveFunction - the function 'derive name proto' defines; null if proto's function cannot be differentiated.
+static std::unique_ptr<FunctionAST> deriveFunction(const std::string &name, const PrototypeAST &proto) {
+    auto found = FunctionTable.find(proto.getName());
+    if (found == FunctionTable.end() || !found->second.declared) {
+        fprintf(stderr, "Error: unknown function '%s'\n", proto.getName().c_str());
+        return nullptr;
+    }
+    const FunctionEntry &origin = found->second;
+    if (!origin.def) {
+        // an extern keeps no parameter names to differentiate with respect to; its partials are still used by callers.
+        fprintf(stderr, "Error: '%s' is an extern; derive a definition calling it instead\n", proto.getName().c_str());
+        return nullptr;
+    }
+    std::vector<std::string> params = origin.def->getProto().getArgs();
+    std::vector<std::unique_ptr<ExprAST>> args;
+    for (unsigned i = 0; i != origin.arity; ++i)
+        args.push_back(std::make_unique<VariableExprAST>(params[i], i));
+
+    std::unique_ptr<ExprAST> body;
+    for (const std::string &wrt : proto.getArgs()) {
+        auto param = std::find(params.begin(), params.end(), wrt);
+        if (param == params.end()) {
+            fprintf(stderr, "Error: '%s' has no parameter '%s'\n", proto.getName().c_str(), wrt.c_str());
+            return nullptr;
+        }
+        auto partial = partialCall(proto.getName(), &origin, args, param - params.begin());
+        if (!partial) {
+            fprintf(stderr, "Error: cannot differentiate '%s'\n", proto.getName().c_str());
+            return nullptr;
+        }
+        body = addTangent(std::move(body), std::move(partial));
+    }
+    return std::make_unique<FunctionAST>(std::make_unique<PrototypeAST>(name, params), body ? std::move(body) : number(0));
+}
+
+//---------------------------------------------------------------------
+// Function Definitions
+//---------------------------------------------------------------------
+
+// unmarkStaleTailCalls - clear the tail flag of the calls in e's tail positions that no longer reach
+// owner, whose body outlived a redefinition of their target. true if any was cleared.
+static bool unmarkStaleTailCalls(ExprAST &e, const FunctionAST &owner) {
+    if (e.getKind() == ExprKind::call) {
+        auto &call = static_cast<CallExprAST &>(e);
+        if (!call.isTailCall() || call.getTarget()->def.get() == &owner)
+            return false;
+        call.setTail(false);
+        return true;
+    }
+    if (e.getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(e);
+        bool then_stale = unmarkStaleTailCalls(*cond.mutableThen(), owner);
+        bool else_stale = unmarkStaleTailCalls(*cond.mutableElse(), owner);
+        return then_stale || else_stale;
+    }
+    return false;
+}
+
+// dropStaleTailCalls - a function was redefined or redeclared: bodies still looping on it as on
+// themselves make those calls ordinary calls and are prepared again.
+static void dropStaleTailCalls() {
+    for (auto &named : FunctionTable) {
+        FunctionAST *def = named.second.def.get();
+        if (def && unmarkStaleTailCalls(*def->mutableBody(), *def))
+            reprepareFunction(*def);
+    }
+}
+
+// declareExtern - record an extern, binding it to a native function when one matches its name and arity.
+// an extern is identified by its name, so that is what calls to it hash.
+static void declareExtern(const PrototypeAST &proto) {
+    FunctionEntry &entry = FunctionTable[proto.getName()];
+    bool redeclared = entry.declared;
+    entry.def.reset();
+    entry.native = nullptr;
+    entry.arity = proto.getArgs().size();
+    entry.declared = true;
+    entry.hash = hashCombine(hashString(proto.getName()), proto.getHash());
+    entry.pure = false;
+    for (const auto &native : NativeFunctions) {
+        if (proto.getName() == native.name && entry.arity == native.arity) {
+            entry.native = native.fn;
+            entry.pure = native.pure;
+        }
+    }
+    if (redeclared) {
+        rebuildSpecializations(entry);
+        rebuildDerivatives(entry);
+        dropStaleTailCalls();
+        refreshFunctionHashes();
+    }
+}
+
+// markTailCalls - flag the self calls whose value is the function's value, so engines loop on them.
+static void markTailCalls(ExprAST &e) {
+    if (e.getKind() == ExprKind::call) {
+        auto &call = static_cast<CallExprAST &>(e);
+        call.setTail(call.isSelfCall());
+    }
+    else if (e.getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(e);
+        markTailCalls(*cond.mutableThen());
+        markTailCalls(*cond.mutableElse());
+    }
+}
+
+// defineFunction - install (or replace) a parsed definition.
+static void defineFunction(std::unique_ptr<FunctionAST> fn) {
+    markTailCalls(*fn->mutableBody());
+    FunctionEntry &entry = FunctionTable[fn->getProto().getName()];
+    bool redefined = entry.declared;
+    entry.native = nullptr;
+    entry.arity = fn->getProto().getArgs().size();
+    entry.declared = true;
+    entry.hash = fn->getHash();
+    entry.pure = fn->getBody().isPure();
+    entry.def = std::move(fn);
+    if (redefined) {
+        rebuildSpecializations(entry);
+        rebuildDerivatives(entry);
+        dropStaleTailCalls();
+        refreshFunctionHashes();
+    }
+    if (dedup_enabled)
+        dedupDefinition(entry);
+    prepareFunction(*entry.def);
+    ipcp_pending = ipcp_enabled;
+}
+
+//---------------------------------------------------------------------
+// Cost Estimation
+//---------------------------------------------------------------------
+
+/*
+estimatedCost() predicts how many operations a call performs without running it, so whatever
+decides to parallelize, inline or compile a function can ask before any profile exists. Literals,
+parameters, operators and calls count one operation each, an if its condition plus its dearer
+branch, a native kNativeCallOps, and a call to a definition that definition's own estimate. A
+function whose calls lead back to itself is recursive: the calls closing the cycle add only their
+own operation, and the activation is assumed to repeat kAssumedRecursionDepth times. Estimates are
+cached in the FunctionEntry until refreshFunctionHashes() sees a definition change.
+*/
+static const double kNativeCallOps = 20;
+static const double kAssumedRecursionDepth = 64;
+static bool print_costs = false;
+
+static CostEstimate estimateEntry(const FunctionEntry &entry, unsigned depth, unsigned &low);
+
+// estimateOps - operations to evaluate e in a function at the given depth of the estimation stack;
+// low drops to the depth of the outermost function being estimated that e calls back into.
+static double estimateOps(const ExprAST &e, unsigned depth, unsigned &low) {
+    switch (e.getKind()) {
+        case ExprKind::number:
+        case ExprKind::variable:
+            return 1;
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            return 1 + estimateOps(bin.getLHS(), depth, low) + estimateOps(bin.getRHS(), depth, low);
+        }
+        case ExprKind::call: {
+            auto &call = static_cast<const CallExprAST &>(e);
+            double ops = 1;
+            for (const auto &arg : call.getArgs())
+                ops += estimateOps(*arg, depth, low);
+            const FunctionEntry *target = call.getTarget();
+            if (call.isSelfCall())
+                low = std::min(low, depth);
+            else if (target->native)
+                ops += kNativeCallOps;
+            else if (target->cost_depth)
+                low = std::min(low, target->cost_depth - 1);
+            else if (target->def)
+                ops += estimateEntry(*target, depth + 1, low).total;
+            return ops;
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<const IfExprAST &>(e);
+            return 1 + estimateOps(cond.getCond(), depth, low) +
+                   std::max(estimateOps(cond.getThen(), depth, low), estimateOps(cond.getElse(), depth, low));
+        }
+    }
+    return 0;
+}
+
+// estimateEntry - the estimate for entry, called at the given depth of the estimation stack.
+static CostEstimate estimateEntry(const FunctionEntry &entry, unsigned depth, unsigned &low) {
+    if (entry.cost_known)
+        return entry.cost;
+    unsigned reached = UINT_MAX;
+    entry.cost_depth = depth + 1;
+    double ops = estimateOps(entry.def->getBody(), depth, reached);
+    entry.cost_depth = 0;
+    if (reached < depth) {
+        // part of a cycle through a caller still being estimated: that caller accounts for the
+        // repetition, and this partial count is not what a call from elsewhere would cost.
+        low = std::min(low, reached);
+        return CostEstimate{ops, ops, true};
+    }
+    entry.cost.recursive = reached == depth;
+    entry.cost.per_call = ops;
+    entry.cost.total = entry.cost.recursive ? ops * kAssumedRecursionDepth : ops;
+    entry.cost_known = true;
+    return entry.cost;
+}
+
+// estimatedCost - the cached estimate for a call of entry; natives and bare externs cost kNativeCallOps and nothing.
+static CostEstimate estimatedCost(const FunctionEntry &entry) {
+    if (!entry.def)
+        return entry.native ? CostEstimate{kNativeCallOps, kNativeCallOps, false} : CostEstimate{};
+    unsigned low = UINT_MAX;
+    return estimateEntry(entry, 0, low);
+}
+
+// printCost - with --print-costs, report the estimate for a function just defined.
+static void printCost(const std::string &name) {
+    CostEstimate cost = estimatedCost(FunctionTable[name]);
+    if (cost.recursive)
+        fprintf(stderr, "Cost of %s: ~%.0f operations (recursive, ~%.0f per level)\n", name.c_str(), cost.total, cost.per_call);
+    else
+        fprintf(stderr, "Cost of %s: ~%.0f operations\n", name.c_str(), cost.total);
+}
+
+//---------------------------------------------------------------------
+// Algebraic Rewriting
+//---------------------------------------------------------------------
+
+/*
+With --fast-math, definitions and top-level expressions are rewritten into forms that evaluate
+faster but may round differently: floating-point addition and multiplication are not associative.
+
+Polynomials: a sum of monomials in one variable such as a*x*x*x + b*x*x + c*x + d costs one multiply
+per factor of every monomial, O(n^2) in the degree. It is regrouped by powers of x and rebuilt in
+Horner form ((a*x + b)*x + c)*x + d, one multiply per degree, or with --poly-form estrin in Estrin
+form (d + c*x) + (b + a*x)*(x*x), whose halves have no dependency on each other. The tree has no
+common subexpressions, so Estrin recomputes each power of x it needs and saves fewer multiplies
+than Horner; what it buys is a dependency chain of logarithmic depth.
+
+Chains: parseBinOpRHS() builds a+b+c+d as ((a+b)+c)+d, a serial dependency chain as deep as it is
+long. Maximal chains of '+' and '-', and of '*', are rebuilt as balanced trees (a+b)+(c+d): the
+operands keep their order, and with it the order of any side effects, but the depth, and the
+recursion depth of every tree walk over it, drops to log2 of the length.
+
+Linear recursion: def sum(n) if n < 1 then 0 else n + sum(n-1) is not tail recursive, as every
+level waits for the next one to add its term. When the body is an if whose one branch is a chain
+of '+' (or of '*') with exactly one self call among its operands, and nothing else in the body
+calls itself or has side effects, the function is split in two:
+    def sum(n) sum.acc(n, 0)
+    def sum.acc(n acc) if n < 1 then acc + 0 else sum.acc(n-1, acc + n)
+The helper calls itself in tail position, which both engines run as a loop, so deep inputs need no
+stack. The terms are now combined in the opposite order, hence --fast-math.
+*/
+enum class PolyForm { horner, estrin };
+static bool fast_math = false;
+static PolyForm poly_form = PolyForm::horner;
+static unsigned poly_rewritten = 0, chains_rebalanced = 0, recursions_converted = 0;
+static uint64_t fast_math_multiplies_before = 0, fast_math_multiplies_after = 0;
+
+// countMultiplies - the number of '*' nodes in e.
+static unsigned countMultiplies(const ExprAST &e) {
+    switch (e.getKind()) {
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            return (bin.getOp() == '*') + countMultiplies(bin.getLHS()) + countMultiplies(bin.getRHS());
+        }
+        case ExprKind::call: {
+            unsigned n = 0;
+            for (const auto &arg : static_cast<const CallExprAST &>(e).getArgs())
+                n += countMultiplies(*arg);
+            return n;
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<const IfExprAST &>(e);
+            return countMultiplies(cond.getCond()) + countMultiplies(cond.getThen()) + countMultiplies(cond.getElse());
+        }
+        default:
+            return 0;
+    }
+}
+
+static bool isBinary(const ExprAST &e, char op) {
+    return e.getKind() == ExprKind::binary && static_cast<const BinaryExprAST &>(e).getOp() == op;
+}
+
+static std::unique_ptr<ExprAST> makeBinary(char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs) {
+    return std::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs));
+}
+
+// Monomial - one signed term of a sum: a constant times the remaining factors.
+struct Monomial {
+    bool negative;
+    double constant = 1.0;
+    std::vector<const ExprAST *> factors;
+};
+
+static void collectFactors(const ExprAST &e, Monomial &term) {
+    if (isBinary(e, '*')) {
+        auto &bin = static_cast<const BinaryExprAST &>(e);
+        collectFactors(bin.getLHS(), term);
+        collectFactors(bin.getRHS(), term);
+    }
+    else if (e.getKind() == ExprKind::number)
+        term.constant *= static_cast<const NumberExprAST &>(e).getVal();
+    else
+        term.factors.push_back(&e);
+}
+
+static void collectTerms(const ExprAST &e, bool negative, std::vector<Monomial> &terms) {
+    if (isBinary(e, '+') || isBinary(e, '-')) {
+        auto &bin = static_cast<const BinaryExprAST &>(e);
+        collectTerms(bin.getLHS(), negative, terms);
+        collectTerms(bin.getRHS(), bin.getOp() == '-' ? !negative : negative, terms);
+        return;
+    }
+    terms.push_back(Monomial{negative, 1.0, {}});
+    collectFactors(e, terms.back());
+}
+
+// degreeIn - the power of parameter slot x in term.
+static unsigned degreeIn(const Monomial &term, unsigned x) {
+    unsigned degree = 0;
+    for (const ExprAST *factor : term.factors)
+        degree += factor->getKind() == ExprKind::variable && static_cast<const VariableExprAST *>(factor)->getIndex() == x;
+    return degree;
+}
+
+// SignedExpr - the value -expr if negative, else expr; a null expr stands for zero.
+// Kaleidoscope has no unary minus, so signs are carried along and folded into '+' and '-'.
+struct SignedExpr {
+    bool negative = false;
+    std::unique_ptr<ExprAST> expr;
+};
+
+static SignedExpr signedNumber(double val) {
+    if (val == 0)
+        return {};
+    return {val < 0, std::make_unique<NumberExprAST>(fabs(val))};
+}
+
+static SignedExpr addSigned(SignedExpr a, SignedExpr b) {
+    if (!a.expr)
+        return b;
+    if (!b.expr)
+        return a;
+    a.expr = makeBinary(a.negative == b.negative ? '+' : '-', std::move(a.expr), std::move(b.expr));
+    return a;
+}
+
+static SignedExpr mulSigned(SignedExpr a, std::unique_ptr<ExprAST> factor) {
+    if (a.expr)
+        a.expr = makeBinary('*', std::move(a.expr), std::move(factor));
+    return a;
+}
+
+static std::unique_ptr<ExprAST> finishSigned(SignedExpr value) {
+    if (!value.expr)
+        return std::make_unique<NumberExprAST>(0.0);
+    if (!value.negative)
+        return std::move(value.expr);
+    if (value.expr->getKind() == ExprKind::number)
+        return std::make_unique<NumberExprAST>(-static_cast<const NumberExprAST &>(*value.expr).getVal());
+    return makeBinary('-', std::make_unique<NumberExprAST>(0.0), std::move(value.expr));
+}
+
+// buildCoefficient - the sum of terms, all of the same degree, with their factors of x left out.
+static SignedExpr buildCoefficient(const std::vector<const Monomial *> &terms, unsigned x) {
+    SignedExpr sum;
+    double constant_sum = 0;
+    for (const Monomial *term : terms) {
+        std::unique_ptr<ExprAST> product;
+        for (const ExprAST *factor : term->factors) {
+            if (factor->getKind() == ExprKind::variable && static_cast<const VariableExprAST *>(factor)->getIndex() == x)
+                continue;
+            product = product ? makeBinary('*', std::move(product), factor->clone()) : factor->clone();
+        }
+        double constant = term->negative ? -term->constant : term->constant;
+        if (!product) {
+            constant_sum += constant;
+            continue;
+        }
+        if (fabs(constant) != 1.0)
+            product = makeBinary('*', std::make_unique<NumberExprAST>(fabs(constant)), std::move(product));
+        sum = addSigned(std::move(sum), SignedExpr{constant < 0, std::move(product)});
+    }
+    return addSigned(std::move(sum), signedNumber(constant_sum));
+}
+
+// buildPower - x^power for a power of two, by repeated squaring.
+static std::unique_ptr<ExprAST> buildPower(const ExprAST &x, size_t power) {
+    if (power == 1)
+        return x.clone();
+    return makeBinary('*', buildPower(x, power / 2), buildPower(x, power / 2));
+}
+
+// buildEstrin - coeffs[lo, lo+len) as low + high * x^m, splitting at the largest power of two m < len.
+static SignedExpr buildEstrin(std::vector<SignedExpr> &coeffs, size_t lo, size_t len, const ExprAST &x) {
+    if (len == 1)
+        return std::move(coeffs[lo]);
+    size_t m = 1;
+    while (m * 2 < len)
+        m *= 2;
+    SignedExpr low = buildEstrin(coeffs, lo, m, x);
+    SignedExpr high = buildEstrin(coeffs, lo + m, len - m, x);
+    return addSigned(std::move(low), mulSigned(std::move(high), buildPower(x, m)));
+}
+
+// rewritePolynomial - e in Horner or Estrin form, or null when e is not a pure sum of degree two or more
+// in some parameter, or would not get cheaper. x is the parameter with the highest power in any term.
+static std::unique_ptr<ExprAST> rewritePolynomial(const ExprAST &e) {
+    if (!(isBinary(e, '+') || isBinary(e, '-')) || !e.isPure())
+        return nullptr;
+    std::vector<Monomial> terms;
+    collectTerms(e, false, terms);
+
+    const ExprAST *x_node = nullptr;
+    unsigned x = 0, degree = 1;
+    for (const Monomial &term : terms) {
+        for (const ExprAST *factor : term.factors) {
+            if (factor->getKind() != ExprKind::variable)
+                continue;
+            unsigned index = static_cast<const VariableExprAST *>(factor)->getIndex();
+            unsigned d = degreeIn(term, index);
+            if (d > degree) {
+                x_node = factor;
+                x = index;
+                degree = d;
+            }
+        }
+    }
+    if (!x_node)
+        return nullptr;
+
+    std::vector<std::vector<const Monomial *>> by_degree(degree + 1);
+    for (const Monomial &term : terms)
+        by_degree[degreeIn(term, x)].push_back(&term);
+    std::vector<SignedExpr> coeffs;
+    for (const auto &same_degree : by_degree)
+        coeffs.push_back(buildCoefficient(same_degree, x));
+
+    SignedExpr poly;
+    if (poly_form == PolyForm::estrin)
+        poly = buildEstrin(coeffs, 0, coeffs.size(), *x_node);
+    else {
+        poly = std::move(coeffs[degree]);
+        for (size_t k = degree; k-- > 0;)
+            poly = addSigned(mulSigned(std::move(poly), x_node->clone()), std::move(coeffs[k]));
+    }
+    auto result = finishSigned(std::move(poly));
+    if (countMultiplies(*result) >= countMultiplies(e))
+        return nullptr;
+    return result;
+}
+
+// rewritePolynomials - rewrite every maximal polynomial in e, outermost first.
+static void rewritePolynomials(std::unique_ptr<ExprAST> &e) {
+    if (auto poly = rewritePolynomial(*e)) {
+        e = std::move(poly);
+        ++poly_rewritten;
+    }
+    if (e->getKind() == ExprKind::binary) {
+        auto &bin = static_cast<BinaryExprAST &>(*e);
+        rewritePolynomials(bin.mutableLHS());
+        rewritePolynomials(bin.mutableRHS());
+    }
+    else if (e->getKind() == ExprKind::call) {
+        for (auto &arg : static_cast<CallExprAST &>(*e).mutableArgs())
+            rewritePolynomials(arg);
+    }
+    else if (e->getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(*e);
+        rewritePolynomials(cond.mutableCond());
+        rewritePolynomials(cond.mutableThen());
+        rewritePolynomials(cond.mutableElse());
+    }
+}
+
+static bool isChainOp(const ExprAST &e, bool additive) {
+    return additive ? isBinary(e, '+') || isBinary(e, '-') : isBinary(e, '*');
+}
+
+// collectChain - move the operands of the chain rooted at e into operands, in order, with their signs.
+static void collectChain(std::unique_ptr<ExprAST> &e, bool additive, bool negative, std::vector<SignedExpr> &operands) {
+    if (isChainOp(*e, additive)) {
+        auto &bin = static_cast<BinaryExprAST &>(*e);
+        collectChain(bin.mutableLHS(), additive, negative, operands);
+        collectChain(bin.mutableRHS(), additive, bin.getOp() == '-' ? !negative : negative, operands);
+        return;
+    }
+    operands.push_back(SignedExpr{negative, std::move(e)});
+}
+
+static SignedExpr buildBalanced(std::vector<SignedExpr> &operands, size_t lo, size_t len, bool additive) {
+    if (len == 1)
+        return std::move(operands[lo]);
+    size_t left = len - len / 2;
+    SignedExpr lhs = buildBalanced(operands, lo, left, additive);
+    SignedExpr rhs = buildBalanced(operands, lo + left, len - left, additive);
+    if (additive)
+        return addSigned(std::move(lhs), std::move(rhs));
+    return {false, makeBinary('*', std::move(lhs.expr), std::move(rhs.expr))};
+}
+
+// rebalanceChains - rebuild every maximal chain of three or more operands in e as a balanced tree.
+static void rebalanceChains(std::unique_ptr<ExprAST> &e) {
+    if (e->getKind() == ExprKind::call) {
+        for (auto &arg : static_cast<CallExprAST &>(*e).mutableArgs())
+            rebalanceChains(arg);
+        return;
+    }
+    if (e->getKind() == ExprKind::conditional) {
+        auto &cond = static_cast<IfExprAST &>(*e);
+        rebalanceChains(cond.mutableCond());
+        rebalanceChains(cond.mutableThen());
+        rebalanceChains(cond.mutableElse());
+        return;
+    }
+    if (e->getKind() != ExprKind::binary)
+        return;
+    auto &bin = static_cast<BinaryExprAST &>(*e);
+    bool additive = bin.getOp() == '+' || bin.getOp() == '-';
+    if ((additive || bin.getOp() == '*') && (isChainOp(bin.getLHS(), additive) || isChainOp(bin.getRHS(), additive))) {
+        std::vector<SignedExpr> operands;
+        collectChain(e, additive, false, operands);
+        for (SignedExpr &operand : operands)
+            rebalanceChains(operand.expr);
+        e = finishSigned(buildBalanced(operands, 0, operands.size(), additive));
+        ++chains_rebalanced;
+        return;
+    }
+    rebalanceChains(bin.mutableLHS());
+    rebalanceChains(bin.mutableRHS());
+}
+
+// callsSelf - e contains a call of the function being defined.
+static bool callsSelf(const ExprAST &e) {
+    switch (e.getKind()) {
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            return callsSelf(bin.getLHS()) || callsSelf(bin.getRHS());
+        }
+        case ExprKind::call: {
+            auto &call = static_cast<const CallExprAST &>(e);
+            if (call.isSelfCall())
+                return true;
+            for (const auto &arg : call.getArgs())
+                if (callsSelf(*arg))
+                    return true;
+            return false;
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<const IfExprAST &>(e);
+            return callsSelf(cond.getCond()) || callsSelf(cond.getThen()) || callsSelf(cond.getElse());
+        }
+        default:
+            return false;
+    }
+}
+
+static void collectOperands(const ExprAST &e, char op, std::vector<const ExprAST *> &operands) {
+    if (isBinary(e, op)) {
+        auto &bin = static_cast<const BinaryExprAST &>(e);
+        collectOperands(bin.getLHS(), op, operands);
+        collectOperands(bin.getRHS(), op, operands);
+    }
+    else
+        operands.push_back(&e);
+}
+
+// introduceAccumulator - if fn is linearly recursive as described above, rewrite it to call a new
+// accumulator-passing helper and return the helper, to be defined first; otherwise null.
+static std::unique_ptr<FunctionAST> introduceAccumulator(FunctionAST &fn) {
+    const ExprAST &body = fn.getBody();
+    if (body.getKind() != ExprKind::conditional || !body.isPure())
+        return nullptr;
+    auto &cond = static_cast<const IfExprAST &>(body);
+    bool recursive_then = callsSelf(cond.getThen());
+    if (callsSelf(cond.getCond()) || recursive_then == callsSelf(cond.getElse()))
+        return nullptr;
+    const ExprAST &step = recursive_then ? cond.getThen() : cond.getElse();
+    const ExprAST &base = recursive_then ? cond.getElse() : cond.getThen();
+
+    // step must be term op ... op self(args) op ... op term.
+    char op = isBinary(step, '+') ? '+' : isBinary(step, '*') ? '*' : 0;
+    if (!op)
+        return nullptr;
+    std::vector<const ExprAST *> operands;
+    collectOperands(step, op, operands);
+    const CallExprAST *recursion = nullptr;
+    std::unique_ptr<ExprAST> term;
+    for (const ExprAST *operand : operands) {
+        if (operand->getKind() == ExprKind::call && static_cast<const CallExprAST *>(operand)->isSelfCall() && !recursion)
+            recursion = static_cast<const CallExprAST *>(operand);
+        else if (callsSelf(*operand))
+            return nullptr;
+        else
+            term = term ? makeBinary(op, std::move(term), operand->clone()) : operand->clone();
+    }
+    unsigned arity = fn.getProto().getArgs().size();
+    if (!recursion || !term || recursion->getArgs().size() != arity)
+        return nullptr;
+    for (const auto &arg : recursion->getArgs())
+        if (callsSelf(*arg))
+            return nullptr;
+
+    // helper(params..., acc) = if cond then acc op base else helper(args..., acc op term)
+    std::string name = fn.getProto().getName() + ".acc";
+    const FunctionEntry *helper_entry = &FunctionTable[name];
+    std::vector<std::string> params = fn.getProto().getArgs();
+    params.push_back("acc");
+    std::vector<std::unique_ptr<ExprAST>> next_args;
+    for (const auto &arg : recursion->getArgs())
+        next_args.push_back(arg->clone());
+    next_args.push_back(makeBinary(op, std::make_unique<VariableExprAST>("acc", arity), std::move(term)));
+    std::unique_ptr<ExprAST> recurse = std::make_unique<CallExprAST>(name, std::move(next_args), helper_entry, true);
+    std::unique_ptr<ExprAST> finish = makeBinary(op, std::make_unique<VariableExprAST>("acc", arity), base.clone());
+    auto helper_body = std::make_unique<IfExprAST>(cond.getCond().clone(), std::move(recursive_then ? recurse : finish),
+                                                   std::move(recursive_then ? finish : recurse));
+    auto helper = std::make_unique<FunctionAST>(std::make_unique<PrototypeAST>(name, params), std::move(helper_body));
+
+    // fn(params...) = helper(params..., identity of op)
+    std::vector<std::unique_ptr<ExprAST>> entry_args;
+    for (unsigned i = 0; i != arity; ++i)
+        entry_args.push_back(std::make_unique<VariableExprAST>(fn.getProto().getArgs()[i], i));
+    entry_args.push_back(std::make_unique<NumberExprAST>(op == '+' ? 0.0 : 1.0));
+    fn.mutableBody() = std::make_unique<CallExprAST>(name, std::move(entry_args), helper_entry, false);
+    ++recursions_converted;
+    return helper;
+}
+
+//---------------------------------------------------------------------
+// Equality Saturation
+//---------------------------------------------------------------------
+
+/*
+With --egraph, every arithmetic region of a body - a maximal pure subtree of '+', '-', '*' and '<'
+over literals, parameters and opaque leaves (calls and ifs, whose insides are regions of their own)
+- is optimized by equality saturation. The region goes into an e-graph, whose classes each hold
+every expression proven equal so far; rules add equal forms until nothing new appears or a limit
+is hit, and the cheapest member under machineCost() is taken out again. Literal subtrees are folded
+before the region goes in, and the node limit is at most kEGraphNodesPerNode times the region's
+own size: associativity and commutativity make the forms of an n-term sum grow exponentially, and
+without that bound every region of a few terms would run to --egraph-nodes or --egraph-time-ms.
+Rules that hold exactly in IEEE arithmetic always apply: commutativity of '+' and '*',
+x*1 = x, x-(+0) = x and folding operators on literals. Associativity, distributivity in both
+directions, x+0 = x, x-(-0) = x, x*0 = 0 and x-x = 0 hold only up to rounding, signed zeros and
+NaNs, so they also need --fast-math.
+*/
+static bool egraph_enabled = false;
+static size_t egraph_node_limit = 10000;
+static unsigned egraph_time_ms = 10;
+static const size_t kEGraphNodesPerNode = 32;
+static unsigned egraph_regions = 0, egraph_improved = 0, egraph_limited = 0;
+static uint64_t egraph_cost_before = 0, egraph_cost_after = 0;
+
+// machineCost - estimated cycles to evaluate e: latency-bound scalar double arithmetic, calls at a fixed overhead.
+enum : unsigned { kCostOperand = 1, kCostAdd = 4, kCostMul = 4, kCostCompare = 3, kCostBranch = 2, kCostCall = 20 };
+
+static unsigned machineCost(const ExprAST &e) {
+    switch (e.getKind()) {
+        case ExprKind::number:
+        case ExprKind::variable:
+            return kCostOperand;
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            unsigned op = bin.getOp() == '*' ? kCostMul : bin.getOp() == '<' ? kCostCompare : kCostAdd;
+            return op + machineCost(bin.getLHS()) + machineCost(bin.getRHS());
+        }
+        case ExprKind::call: {
+            unsigned cost = kCostCall;
+            for (const auto &arg : static_cast<const CallExprAST &>(e).getArgs())
+                cost += machineCost(*arg);
+            return cost;
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<const IfExprAST &>(e);
+            return kCostBranch + machineCost(cond.getCond()) + std::max(machineCost(cond.getThen()), machineCost(cond.getElse()));
+        }
+    }
+    return 0;
+}
+
+// ENode - an operator over e-classes, or a literal, parameter or opaque leaf.
+struct ENode {
+    enum Op : uint8_t { num, var, leaf, add, sub, mul, less } op;
+    uint32_t lhs = 0, rhs = 0;
+    uint64_t payload = 0; // bits of a num, slot of a var, index of a leaf
+
+    bool isBinary() const { return op >= add; }
+    bool operator==(const ENode &o) const { return op == o.op && lhs == o.lhs && rhs == o.rhs && payload == o.payload; }
+    bool operator<(const ENode &o) const {
+        return std::tie(op, lhs, rhs, payload) < std::tie(o.op, o.lhs, o.rhs, o.payload);
+    }
+};
+
+struct ENodeHash {
+    size_t operator()(const ENode &n) const { return hashCombine(hashCombine(hashCombine(n.op, n.lhs), n.rhs), n.payload); }
+};
+
+// EGraph - e-classes under union-find, with a hash-cons of canonical nodes.
+class EGraph {
+    std::vector<uint32_t> parent;
+    std::vector<std::vector<ENode>> classes; // live for roots only
+    std::unordered_map<ENode, uint32_t, ENodeHash> memo;
+    uint64_t changes = 0;
+
+    ENode canonical(ENode n) {
+        if (n.isBinary()) {
+            n.lhs = find(n.lhs);
+            n.rhs = find(n.rhs);
+        }
+        return n;
+    }
+
+public:
+    uint32_t find(uint32_t c) {
+        while (parent[c] != c)
+            c = parent[c] = parent[parent[c]];
+        return c;
+    }
+
+    size_t numClasses() const { return parent.size(); }
+    size_t numNodes() const { return memo.size(); }
+    uint64_t numChanges() const { return changes; }
+    const std::vector<ENode> &nodes(uint32_t c) { return classes[find(c)]; }
+
+    uint32_t add(ENode n) {
+        n = canonical(n);
+        auto found = memo.find(n);
+        if (found != memo.end())
+            return find(found->second);
+        uint32_t c = parent.size();
+        parent.push_back(c);
+        classes.push_back({n});
+        memo.emplace(n, c);
+        ++changes;
+        return c;
+    }
+
+    void merge(uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        if (a == b)
+            return;
+        if (classes[a].size() < classes[b].size())
+            std::swap(a, b);
+        parent[b] = a;
+        classes[a].insert(classes[a].end(), classes[b].begin(), classes[b].end());
+        classes[b].clear();
+        ++changes;
+    }
+
+    // rebuild - after merges, make every node canonical again and merge classes holding congruent nodes.
+    void rebuild() {
+        std::vector<std::pair<uint32_t, uint32_t>> congruent;
+        do {
+            for (auto &pair : congruent)
+                merge(pair.first, pair.second);
+            congruent.clear();
+            memo.clear();
+            for (uint32_t c = 0; c != parent.size(); ++c) {
+                if (find(c) != c)
+                    continue;
+                auto &list = classes[c];
+                for (ENode &n : list)
+                    n = canonical(n);
+                std::sort(list.begin(), list.end());
+                list.erase(std::unique(list.begin(), list.end()), list.end());
+                for (const ENode &n : list) {
+                    auto inserted = memo.emplace(n, c);
+                    if (!inserted.second && find(inserted.first->second) != c)
+                        congruent.emplace_back(inserted.first->second, c);
+                }
+            }
+        } while (!congruent.empty());
+    }
+
+    // constant - the literal in class c, if it has one.
+    bool constant(uint32_t c, double &val) {
+        for (const ENode &n : nodes(c)) {
+            if (n.op == ENode::num) {
+                memcpy(&val, &n.payload, sizeof(val));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t number(double val) {
+        ENode n{ENode::num};
+        memcpy(&n.payload, &val, sizeof(val));
+        return add(n);
+    }
+};
+
+static double applyENode(ENode::Op op, double l, double r) {
+    switch (op) {
+        case ENode::add: return l + r;
+        case ENode::sub: return l - r;
+        case ENode::mul: return l * r;
+        default: return l < r ? 1.0 : 0.0;
+    }
+}
+
+// applyRules - add everything the rules derive from node n of class c.
+static void applyRules(EGraph &g, uint32_t c, const ENode &n) {
+    if (!n.isBinary())
+        return;
+    double l, r;
+    bool l_const = g.constant(n.lhs, l), r_const = g.constant(n.rhs, r);
+    if (l_const && r_const)
+        g.merge(c, g.number(toSessionPrecision(applyENode(n.op, toSessionPrecision(l), toSessionPrecision(r)))));
+    if (n.op == ENode::add || n.op == ENode::mul)
+        g.merge(c, g.add(ENode{n.op, n.rhs, n.lhs}));
+    // x - (-0) is x + 0, which is +0 for x = -0: only subtracting +0 is exact.
+    if ((n.op == ENode::mul && r_const && r == 1.0) || (n.op == ENode::sub && r_const && r == 0.0 && !std::signbit(r)))
+        g.merge(c, n.lhs);
+    if (!fast_math)
+        return;
+
+    if ((n.op == ENode::add || n.op == ENode::sub) && r_const && r == 0.0)
+        g.merge(c, n.lhs);
+    if (n.op == ENode::mul && r_const && r == 0.0)
+        g.merge(c, g.number(0.0));
+    if (n.op == ENode::sub && g.find(n.lhs) == g.find(n.rhs))
+        g.merge(c, g.number(0.0));
+
+    // (a op b) op c = a op (b op c)
+    if (n.op == ENode::add || n.op == ENode::mul) {
+        std::vector<ENode> inner = g.nodes(n.lhs);
+        for (const ENode &m : inner)
+            if (m.op == n.op)
+                g.merge(c, g.add(ENode{n.op, m.lhs, g.add(ENode{n.op, m.rhs, n.rhs})}));
+    }
+    // a * (b +- c) = a*b +- a*c
+    if (n.op == ENode::mul) {
+        std::vector<ENode> inner = g.nodes(n.rhs);
+        for (const ENode &m : inner)
+            if (m.op == ENode::add || m.op == ENode::sub)
+                g.merge(c, g.add(ENode{m.op, g.add(ENode{ENode::mul, n.lhs, m.lhs}), g.add(ENode{ENode::mul, n.lhs, m.rhs})}));
+    }
+    // a*b +- a*c = a * (b +- c)
+    if (n.op == ENode::add || n.op == ENode::sub) {
+        std::vector<ENode> lhs = g.nodes(n.lhs), rhs = g.nodes(n.rhs);
+        for (const ENode &x : lhs)
+            for (const ENode &y : rhs)
+                if (x.op == ENode::mul && y.op == ENode::mul && g.find(x.lhs) == g.find(y.lhs))
+                    g.merge(c, g.add(ENode{ENode::mul, x.lhs, g.add(ENode{n.op, x.rhs, y.rhs})}));
+    }
+}
+
+// Region - the opaque parts of an arithmetic region, by the payloads its e-graph refers to them with.
+struct Region {
+    std::vector<const ExprAST *> leaves;
+    std::vector<unsigned> leaf_costs;
+    std::map<unsigned, std::string> var_names;
+};
+
+static uint32_t insertRegion(EGraph &g, const ExprAST &e, Region &region) {
+    switch (e.getKind()) {
+        case ExprKind::number:
+            return g.number(static_cast<const NumberExprAST &>(e).getVal());
+        case ExprKind::variable: {
+            auto &var = static_cast<const VariableExprAST &>(e);
+            region.var_names[var.getIndex()] = var.getName();
+            return g.add(ENode{ENode::var, 0, 0, var.getIndex()});
+        }
+        case ExprKind::binary: {
+            auto &bin = static_cast<const BinaryExprAST &>(e);
+            ENode::Op op = bin.getOp() == '+' ? ENode::add : bin.getOp() == '-' ? ENode::sub : bin.getOp() == '*' ? ENode::mul : ENode::less;
+            uint32_t lhs = insertRegion(g, bin.getLHS(), region);
+            uint32_t rhs = insertRegion(g, bin.getRHS(), region);
+            return g.add(ENode{op, lhs, rhs});
+        }
+        default:
+            region.leaves.push_back(&e);
+            region.leaf_costs.push_back(machineCost(e));
+            return g.add(ENode{ENode::leaf, 0, 0, region.leaves.size() - 1});
+    }
+}
+
+// extractCheapest - the cheapest expression of class root. Every node costs at least one, so the
+// choices made form no cycles.
+static std::unique_ptr<ExprAST> extractCheapest(EGraph &g, uint32_t root, const Region &region) {
+    const uint64_t kNone = UINT64_MAX;
+    std::vector<uint64_t> cost(g.numClasses(), kNone);
+    std::vector<ENode> best(g.numClasses());
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (uint32_t c = 0; c != g.numClasses(); ++c) {
+            if (g.find(c) != c)
+                continue;
+            for (const ENode &n : g.nodes(c)) {
+                uint64_t node_cost;
+                switch (n.op) {
+                    case ENode::num: case ENode::var: node_cost = kCostOperand; break;
+                    case ENode::leaf: node_cost = region.leaf_costs[n.payload]; break;
+                    case ENode::mul: node_cost = kCostMul; break;
+                    case ENode::less: node_cost = kCostCompare; break;
+                    default: node_cost = kCostAdd; break;
+                }
+                if (n.isBinary()) {
+                    if (cost[g.find(n.lhs)] == kNone || cost[g.find(n.rhs)] == kNone)
+                        continue;
+                    node_cost += cost[g.find(n.lhs)] + cost[g.find(n.rhs)];
+                }
+                if (node_cost < cost[c]) {
+                    cost[c] = node_cost;
+                    best[c] = n;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::function<std::unique_ptr<ExprAST>(uint32_t)> build = [&](uint32_t c) -> std::unique_ptr<ExprAST> {
+        const ENode &n = best[g.find(c)];
+        switch (n.op) {
+            case ENode::num: {
+                double val;
+                memcpy(&val, &n.payload, sizeof(val));
+                return std::make_unique<NumberExprAST>(val);
+            }
+            case ENode::var:
+                return std::make_unique<VariableExprAST>(region.var_names.at(n.payload), n.payload);
+            case ENode::leaf:
+                return region.leaves[n.payload]->clone();
+            default: {
+                char op = n.op == ENode::add ? '+' : n.op == ENode::sub ? '-' : n.op == ENode::mul ? '*' : '<';
+                return makeBinary(op, build(n.lhs), build(n.rhs));
+            }
+        }
+    };
+    return build(root);
+}
+
+// saturateRegion - replace the region rooted at e by its cheapest equal form.
+static void saturateRegion(std::unique_ptr<ExprAST> &e) {
+    unsigned before = machineCost(*e);
+    ++egraph_regions;
+    egraph_cost_before += before;
+    foldConstants(e);
+    if (e->getKind() != ExprKind::binary) {
+        egraph_improved += machineCost(*e) < before;
+        egraph_cost_after += machineCost(*e);
+        return;
+    }
+
+    EGraph g;
+    Region region;
+    uint32_t root = insertRegion(g, *e, region);
+
+    size_t node_limit = std::min(egraph_node_limit, kEGraphNodesPerNode * g.numNodes());
+    auto deadline = Clock::now() + std::chrono::milliseconds(egraph_time_ms);
+    bool limited = false;
+    for (uint64_t before = ~0ull; g.numChanges() != before && !limited;) {
+        before = g.numChanges();
+        std::vector<std::pair<uint32_t, ENode>> snapshot;
+        for (uint32_t c = 0; c != g.numClasses(); ++c)
+            if (g.find(c) == c)
+                for (const ENode &n : g.nodes(c))
+                    snapshot.emplace_back(c, n);
+        for (size_t i = 0; i != snapshot.size(); ++i) {
+            applyRules(g, snapshot[i].first, snapshot[i].second);
+            if (g.numNodes() > node_limit || ((i & 63) == 0 && Clock::now() > deadline)) {
+                limited = true;
+                break;
+            }
+        }
+        g.rebuild();
+    }
+
+    auto cheapest = extractCheapest(g, root, region);
+    unsigned folded = machineCost(*e), after = machineCost(*cheapest);
+    egraph_limited += limited;
+    if (after < folded)
+        e = std::move(cheapest);
+    egraph_improved += std::min(folded, after) < before;
+    egraph_cost_after += std::min(folded, after);
+}
+
+// saturateRegions - optimize every arithmetic region in e, innermost leaves first.
+static void saturateRegions(std::unique_ptr<ExprAST> &e, bool in_region = false) {
+    switch (e->getKind()) {
+        case ExprKind::binary: {
+            auto &bin = static_cast<BinaryExprAST &>(*e);
+            saturateRegions(bin.mutableLHS(), true);
+            saturateRegions(bin.mutableRHS(), true);
+            if (!in_region && e->isPure())
+                saturateRegion(e);
+            break;
+        }
+        case ExprKind::call:
+            for (auto &arg : static_cast<CallExprAST &>(*e).mutableArgs())
+                saturateRegions(arg);
+            break;
+        case ExprKind::conditional: {
+            auto &cond = static_cast<IfExprAST &>(*e);
+            saturateRegions(cond.mutableCond());
+            saturateRegions(cond.mutableThen());
+            saturateRegions(cond.mutableElse());
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//---------------------------------------------------------------------
+// Canonical Operand Order
+//---------------------------------------------------------------------
+
+/*
+x+y and y+x evaluate to the same bits - IEEE addition and multiplication are commutative - but
+hash differently, so the result cache and deduplication miss one when they have seen the other.
+Every parsed body therefore has the operands of its '+' and '*' nodes put in one order, by kind
+and then structural hash. Operands are only swapped when at least one of them is pure, so side
+effects keep their order.
+*/
+// operandsInOrder - whether a belongs before b as the operands of a commutative operator.
+static bool operandsInOrder(const ExprAST &a, const ExprAST &b) {
+    if (a.getKind() != b.getKind())
+        return a.getKind() < b.getKind();
+    return a.getHash() <= b.getHash();
+}
+
+// canonicalizeOperands - sort the operands of every commutative operator in e, updating hashes on the way up.
+static void canonicalizeOperands(ExprAST &e) {
+    switch (e.getKind()) {
+        case ExprKind::binary: {
+            auto &bin = static_cast<BinaryExprAST &>(e);
+            canonicalizeOperands(*bin.mutableLHS());
+            canonicalizeOperands(*bin.mutableRHS());
+            if ((bin.getOp() == '+' || bin.getOp() == '*') && !operandsInOrder(bin.getLHS(), bin.getRHS()) &&
+                (bin.getLHS().isPure() || bin.getRHS().isPure()))
+                std::swap(bin.mutableLHS(), bin.mutableRHS());
+            bin.updateHash();
+            break;
+        }
+        case ExprKind::call: {
+            auto &call = static_cast<CallExprAST &>(e);
+            for (auto &arg : call.mutableArgs())
+                canonicalizeOperands(*arg);
+            call.updateHash();
+            break;
+        }
+        case ExprKind::conditional: {
+            auto &cond = static_cast<IfExprAST &>(e);
+            canonicalizeOperands(*cond.mutableCond());
+            canonicalizeOperands(*cond.mutableThen());
+            canonicalizeOperands(*cond.mutableElse());
+            cond.updateHash();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//---------------------------------------------------------------------
+// Optimization Pipeline
+//---------------------------------------------------------------------
+
+// optimizeFunction - apply the enabled rewrites to a parsed definition or top-level expression,
+// then put its operands in canonical order.
+static void optimizeFunction(FunctionAST &fn) {
+    if (egraph_enabled)
+        saturateRegions(fn.mutableBody());
+    if (fast_math) {
+        fast_math_multiplies_before += countMultiplies(fn.getBody());
+        rewritePolynomials(fn.mutableBody());
+        rebalanceChains(fn.mutableBody());
+        fast_math_multiplies_after += countMultiplies(fn.getBody());
+    }
+    canonicalizeOperands(*fn.mutableBody());
+}
+
+//---------------------------------------------------------------------
+// Slow-Item Log
+//---------------------------------------------------------------------
+
+// SlowItem - one top-level item that exceeded the threshold in some phase.
+struct SlowItem {
+    uint64_t offset, length; // source span, in input bytes
+    uint64_t lex_ns, parse_ns, exec_ns;
+    unsigned nodes, depth;
+    std::string text;
+
+    uint64_t worstNs() const { return std::max(lex_ns, std::max(parse_ns, exec_ns)); }
+};
+
+/*
+SlowItemLog - keeps the slowest `capacity` items whose lex, parse or execute time exceeded the threshold,
+so outliers in a large batch can be found without a profiler. Enabling it turns on lexer timing and
+source capture; both stay off otherwise.
+*/
+class SlowItemLog {
+    std::vector<SlowItem> items;
+    size_t capacity = 0;
+    uint64_t threshold_ns = 0;
+    uint64_t item_start = 0;
+
+public:
+    void enable(uint64_t threshold_us, size_t log_size) {
+        threshold_ns = threshold_us * 1000;
+        capacity = log_size;
+        time_lexer = true;
+        capture_enabled = true;
+    }
+
+    bool enabled() const { return capacity != 0; }
+
+    // beginItem - the current token starts a new top-level item.
+    void beginItem() {
+        if (!enabled())
+            return;
+        item_start = tok_start;
+        lex_ns = 0;
+        restartCapture(tok_start);
+    }
+
+    // endItem - called once the item is parsed (and executed); parse_total_ns includes lexing.
+    void endItem(uint64_t parse_total_ns, uint64_t exec_ns, const FunctionAST *fn) {
+        if (!enabled())
+            return;
+        SlowItem item;
+        item.lex_ns = lex_ns;
+        item.parse_ns = parse_total_ns > lex_ns ? parse_total_ns - lex_ns : 0;
+        item.exec_ns = exec_ns;
+        if (item.worstNs() <= threshold_ns)
+            return;
+
+        // the parser has already read the next item's first token, so the span ends where it starts.
+        item.offset = item_start;
+        item.length = tok_start - item_start;
+        item.nodes = fn ? fn->getBody().countNodes() : 0;
+        item.depth = fn ? fn->getBody().depth() : 0;
+        item.text = captureText(item_start, tok_start);
+        std::replace(item.text.begin(), item.text.end(), '\n', ' ');
+
+        if (items.size() < capacity) {
+            items.push_back(std::move(item));
+            return;
+        }
+        auto fastest = std::min_element(items.begin(), items.end(),
+                                        [](const SlowItem &a, const SlowItem &b) { return a.worstNs() < b.worstNs(); });
+        if (fastest->worstNs() < item.worstNs())
+            *fastest = std::move(item);
+    }
+
+    void report(FILE *out) {
+        std::sort(items.begin(), items.end(), [](const SlowItem &a, const SlowItem &b) { return a.worstNs() > b.worstNs(); });
+        fprintf(out, "%zu slow item(s) over %.1fus:\n", items.size(), threshold_ns / 1e3);
+        for (const SlowItem &item : items) {
+            fprintf(out, "  bytes %llu+%llu: lex %.1fus, parse %.1fus, exec %.1fus, %u nodes, depth %u\n",
+                    (unsigned long long)item.offset, (unsigned long long)item.length,
+                    item.lex_ns / 1e3, item.parse_ns / 1e3, item.exec_ns / 1e3, item.nodes, item.depth);
+            fprintf(out, "    %s\n", item.text.c_str());
+        }
+    }
+};
+
+static SlowItemLog SlowLog;
+
+//---------------------------------------------------------------------
+// Top-Level Parsing
+//---------------------------------------------------------------------
+
+static void handleDefinition() {
+    auto parse_start = Clock::now();
+    auto fn = parseDefinition();
+    uint64_t parse_ns = nanosSince(parse_start);
+    if (fn) {
+        Metrics.parse_latency.observe(parse_ns);
+        Metrics.items_parsed.add();
+        SlowLog.endItem(parse_ns, 0, fn.get());
+        // with --fast-math, linear recursion moves into an accumulator-passing helper first.
+        if (auto helper = fast_math ? introduceAccumulator(*fn) : nullptr) {
+            optimizeFunction(*helper);
+            defineFunction(std::move(helper));
+        }
+        optimizeFunction(*fn);
+        std::string name = fn->getProto().getName();
+        defineFunction(std::move(fn));
+        fprintf(stderr, "Parsed a function definition.\n");
+        if (print_costs)
+            printCost(name);
+    }
+    else {
+        Metrics.parse_errors.add();
+        SlowLog.endItem(parse_ns, 0, nullptr);
+        // skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static void handleExtern() {
+    auto parse_start = Clock::now();
+    auto proto = parseExtern();
+    uint64_t parse_ns = nanosSince(parse_start);
+    if (proto) {
+        Metrics.parse_latency.observe(parse_ns);
+        Metrics.items_parsed.add();
+        SlowLog.endItem(parse_ns, 0, nullptr);
+        declareExtern(*proto);
+        fprintf(stderr, "Parsed an extern\n");
+    }
+    else {
+        Metrics.parse_errors.add();
+        SlowLog.endItem(parse_ns, 0, nullptr);
+        // skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static void handleDerive() {
+    auto parse_start = Clock::now();
+    std::string name;
+    auto proto = parseDerive(name);
+    uint64_t parse_ns = nanosSince(parse_start);
+    if (proto) {
+        Metrics.parse_latency.observe(parse_ns);
+        Metrics.items_parsed.add();
+        SlowLog.endItem(parse_ns, 0, nullptr);
+        if (auto fn = deriveFunction(name, *proto)) {
+            defineFunction(std::move(fn));
+            fprintf(stderr, "Derived a function.\n");
+        }
+    }
+    else {
+        Metrics.parse_errors.add();
+        SlowLog.endItem(parse_ns, 0, nullptr);
+        // skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static void handleTopLevelExpression() {
+    // specializations outlive the item, so they are made before its arena scope opens.
+    if (ipcp_pending)
+        propagateConstants();
+
+    // evaluate a top-level expression into an anonymous function.
+    // the function is discarded afterwards, so its AST lives in the item arena.
+    ArenaScope arena_scope;
+    auto parse_start = Clock::now();
+    auto fn = parseTopLevelExpr();
+    uint64_t parse_ns = nanosSince(parse_start);
+    if (fn) {
+        Metrics.parse_latency.observe(parse_ns);
+        Metrics.items_parsed.add();
+        optimizeFunction(*fn);
 
-// getTokPrecendence
-static int getTokPrecedence() {
-    if (!isascii(cur_tok)) // if tok is not binary operator
-        return -1;
-    
-    // make sure it's a declared binary operator.
-    int tok_prec = BinopPrecedence[cur_tok];
-    if (tok_prec <= 0) return -1;
-    return tok_prec;
-}
+        // pure expressions are looked up by their structural hash first.
+        bool cacheable = result_cache_capacity && fn->getBody().isPure();
+        auto cached = cacheable ? ResultCache.find(fn->getHash()) : ResultCache.end();
 
-auto lhs = std::make_unique<VariableExprAST>("x");
-auto rhs = std::make_unique<VariableExprAST>("y");
-auto result = std::make_unique<BinaryExprAST>('+', std::move(lhs), std::move(rhs));
+        double result;
+        uint64_t eval_ns = 0;
+        eval_error = nullptr;
+        if (cached != ResultCache.end()) {
+            Metrics.cache_hits.add();
+            result = cached->second;
+        }
+        else {
+            auto eval_start = Clock::now();
+            result = evaluateTopLevel(*fn);
+            eval_ns = nanosSince(eval_start);
+            Metrics.eval_latency.observe(eval_ns);
+            if (cacheable && !eval_error) {
+                if (ResultCache.size() >= result_cache_capacity)
+                    ResultCache.clear();
+                ResultCache.emplace(fn->getHash(), result);
+            }
+            if (single_precision && !eval_error && fn->getBody().isPure())
+                comparePrecision(*fn, result);
+        }
+        SlowLog.endItem(parse_ns, eval_ns, fn.get());
 
+        if (eval_error)
+            fprintf(stderr, "Error: %s\n", eval_error);
+        else
+            fprintf(stderr, "Evaluated to %f\n", result);
+        if (bench_iterations && !eval_error)
+            benchmarkEngines(*fn);
+    }
+    else {
+        Metrics.parse_errors.add();
+        SlowLog.endItem(parse_ns, 0, nullptr);
+        // skip token for error recovery.
+        getNextToken();
+    }
+}
 
+// last_item_done - when the previous top-level item produced its result.
+static Clock::time_point last_item_done;
 
+/// top ::= definition | external | expression | ';'
+/// handleItem - handle one top-level item, returns false at the end of the input.
+static bool handleItem() {
+    if (latency_report_requested) {
+        latency_report_requested = 0;
+        reportLatency(stderr);
+    }
 
+    fprintf(stderr, "ready> ");
+    SlowLog.beginItem();
+    switch (cur_tok) {
+        case tok_eof:
+            return false;
+        case ';': // ignore top-level semicolons.
+            getNextToken();
+            return true;
+        case tok_def:
+            handleDefinition();
+            break;
+        case tok_extern:
+            handleExtern();
+            break;
+        case tok_derive:
+            handleDerive();
+            break;
+        default:
+            handleTopLevelExpression();
+            break;
+    }
 
-// logError* - these are little helper functions for error handling.
-std::unique_ptr<ExprAST> logError(const char *str) {
-    fprintf(stderr, "Error: %s\n", str);
-    return nullptr;
+    /* the item's input was complete once the read holding its lookahead token returned. When that
+    read brought several items at once, the later ones sat in the window while the earlier ones ran;
+    their latency starts when the item before them finished, not at the read, or every item would be
+    charged for the processing of all those ahead of it in the same read. */
+    auto done = Clock::now();
+    auto arrival = std::max(input_arrival, last_item_done);
+    Metrics.request_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(done - arrival).count());
+    last_item_done = done;
+    return true;
 }
-std::unique_ptr<PrototypeAST> logErrorP(const char *str) {
-    logError(str);
-    return nullptr;
+
+static void mainLoop() {
+    while (handleItem()) {
+    }
 }
 
 
-//------------------------------------------------------------------
-//Basic Expression Parsing
+//--------------------------------------------------------------
+// Self Checks
+//--------------------------------------------------------------
 
+#ifdef KALEIDOSCOPE_SELF_CHECKS
+// allocation_count - heap allocations made by this thread through operator new.
+static thread_local uint64_t allocation_count = 0;
 
-// numberexpr ::= number
-static std::unique_ptr<ExprAST> parseNumberExpr() {
-    auto result = std::make_unique<NumberExprAST>(num_val);
-    getNextToken();
-    return std::move(result);
+// the replacements stay out of line, or GCC sees malloc/free inlined under new/delete and warns
+// about mismatched allocation functions.
+__attribute__((noinline)) void *operator new(size_t size) {
+    ++allocation_count;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
 }
 
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> parseParenExpr() {
-    getNextToken(); // eat (
-    auto v = parseExpression();
-    if (!v)
-        return nullptr;
-    
-    if (cur_tok != ')')
-        return logError("expected ')'");
-    getNextToken(); // eat )
-    return v;
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
 }
 
-/*
-identifierexpr
-    ::= identifier
-    ::= identifier '(' expression * ')'
-*/
-static std::unique_ptr<ExprAST> parseIdentifierExpr() {
-    std::string id_name = identifier_str;
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
 
-    getNextToken(); // eat identifier
-    
-    if (cur_tok != '(') // simple varaible ref
-        return std::make_unique<VariableExprAST>(id_name);
+// RepeatSource - the same text, `count` times over, at most `batch` copies per read.
+class RepeatSource : public InputSource {
+    const char *text;
+    size_t len, pos = 0;
+    unsigned count, batch = 1;
 
-    // call
-    getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> args;
-    if (cur_tok != ')') {
-        while (true) {
-            if (auto arg = parseExpression())
-                args.push_back(std::move(arg));
-            else
-                return nullptr;
+public:
+    RepeatSource(const char *text, unsigned count) : text(text), len(strlen(text)), count(count) {}
 
-            if (cur_tok == ')')
-                break;
-            
-            if (cur_tok != ',')
-                return logError("Expected ')' or ',' in argument list");
-            getNextToken();
+    void setBatch(unsigned copies) { batch = copies; }
+
+    size_t read(char *buf, size_t buf_len) override {
+        size_t n = 0;
+        for (unsigned copies = 0; count && copies != batch && n != buf_len;) {
+            size_t chunk = std::min(buf_len - n, len - pos);
+            memcpy(buf + n, text + pos, chunk);
+            n += chunk;
+            pos += chunk;
+            if (pos == len) {
+                pos = 0;
+                --count;
+                ++copies;
+            }
         }
+        return n;
     }
+};
 
-    // eat the ')'
-    getNextToken();
+// silenceStderr - send stderr to /dev/null until restoreStderr() is given the returned descriptor.
+static int silenceStderr() {
+    int saved_stderr = dup(STDERR_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+    return saved_stderr;
+}
 
-    return std::make_unique<CallExprAST>(id_name, std::move(args));
+static void restoreStderr(int saved_stderr) {
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
 }
 
 /*
-primary
-    ::= identifierexpr
-    ::= numberexpr
-    ::= parenexpr
+checkSteadyStateAllocations - after a warm-up, parse and evaluate `iterations` simple top-level
+expressions through the normal REPL path and fail if any of them reached the heap.
+Output of the measured iterations is discarded.
 */
-static std::unique_ptr<ExprAST> parsePrimary() {
-    switch (cur_tok) {
-        default:
-            return logError("unknown token when expecting an expression");
-        case tok_identifier:
-            return parseIdentifierExpr();
-        case tok_number:
-            return parseNumberExpr();
-        case '(':
-            return parseParenExpr();
+static int checkSteadyStateAllocations(unsigned iterations) {
+    static const char *kExpression = "4 + 2 * (3 - 1) < 9;\n";
+    const unsigned kWarmup = 16;
+    RepeatSource source(kExpression, kWarmup + iterations);
+    input = &source;
+
+    int saved_stderr = silenceStderr();
+    getNextToken();
+    // every line is two items: the expression and its ';'.
+    for (unsigned i = 0; i != 2 * kWarmup; ++i)
+        handleItem();
+    uint64_t before = allocation_count;
+    while (handleItem()) {
     }
+    uint64_t allocations = allocation_count - before;
+    restoreStderr(saved_stderr);
+
+    fprintf(stderr, "%llu heap allocation(s) in %u steady-state iterations: %s\n", (unsigned long long)allocations,
+            iterations, allocations ? "FAIL" : "ok");
+    return allocations ? 1 : 0;
 }
 
 /*
-binoprhs
-    ::= ('+' primary)*
+checkLatencyBatching - evaluate `items` simple expressions arriving one per read, then `items` more
+arriving in a single read, and fail if the median request latency of the batch is well above the
+unbatched one: an item's latency must not include the time spent on the items read along with it.
 */
-static std::unique_ptr<ExprAST> parseBinOpRHS(int expr_prec, std::unique_ptr<ExprAST> lhs) {
-    // if this is a binop, find its precedence.
-    while (true) {
-        int tok_prec = getTokPrecedence();
+static int checkLatencyBatching(unsigned items) {
+    static const char *kExpression = "4 + 2 * (3 - 1) < 9;\n";
+    RepeatSource source(kExpression, 2 * items);
+    input = &source;
 
-        // if this is a binop that binds at least as tightly as the current binop,
-        // consume it, otherwise we are done.
-        if (tok_prec < expr_prec)
-            return lhs;
-        
-        // now know this is a binop.
-        int bin_op = cur_tok;
-        getNextToken(); // eat binop
+    int saved_stderr = silenceStderr();
+    getNextToken();
+    // every line is two items: the expression and its ';'.
+    for (unsigned i = 0; i != 2 * items; ++i)
+        handleItem();
+    uint64_t unbatched = Metrics.request_latency.percentile(0.5);
+    Metrics.request_latency.reset();
+    source.setBatch(items);
+    while (handleItem()) {
+    }
+    uint64_t batched = Metrics.request_latency.percentile(0.5);
+    restoreStderr(saved_stderr);
 
-        // parse the primary expression after the binary operator.
-        auto rhs = parsePrimary();
-        if (!rhs)
-            return nullptr;
+    // twice the median plus 20us of slack for scheduling noise on such short items.
+    bool ok = batched <= 2 * unbatched + 20000;
+    fprintf(stderr, "request latency p50: %.1fus one item per read, %.1fus %u items per read: %s\n", unbatched / 1e3,
+            batched / 1e3, items, ok ? "ok" : "FAIL");
+    return ok ? 0 : 1;
+}
 
-        // if bin_op binds less tightly with rhs than the operator after rhs,
-        // let the pending operator take rhs as its lhs.
-        int next_prec = getTokPrecedence();
-        if (tok_prec < next_prec) {
-            rhs = parseBinOpRHS(tok_prec + 1, std::move(rhs));
-            if (!rhs)
-                return nullptr;
+// evaluateText - define and evaluate the items in text; the value of its last top-level expression.
+static double evaluateText(const char *text) {
+    RepeatSource source(text, 1);
+    input = &source;
+    getNextToken();
+    double result = 0.0;
+    while (cur_tok != tok_eof) {
+        if (cur_tok == tok_def)
+            handleDefinition();
+        else if (cur_tok == ';')
+            getNextToken();
+        else {
+            if (ipcp_pending)
+                propagateConstants();
+            if (auto fn = parseTopLevelExpr()) {
+                optimizeFunction(*fn);
+                result = evaluateTopLevel(*fn);
+            }
+            else
+                getNextToken();
         }
-
-        // merge lhs/rhs
-        lhs = std::make_unique<BinaryExprAST>(bin_op, std::move(lhs), std::move(rhs));
     }
+    return result;
 }
 
 /*
-expression
-    ::= primary binoprhs
+checkEgraphExact - without --fast-math the e-graph may only rewrite to forms that give the same
+bits. Evaluate functions whose results hinge on the sign of zero with the e-graph off and on, and
+fail on any difference.
 */
-static std::unique_ptr<ExprAST> parseExpression() {
-    auto lhs = parsePrimary();
-    if (!lhs)
-        return nullptr;
+static int checkEgraphExact() {
+    static const struct {
+        const char *body, *arg;
+    } kCases[] = {
+        {"x - 0*(0-1)", "0*(0-1)"}, // -0 - -0 is +0
+        {"x - 0", "0*(0-1)"},
+        {"x * 1", "0*(0-1)"},
+        {"x + 0", "0*(0-1)"}, // -0 + 0 is +0
+        {"x * 0", "0-1"},     // -1 * 0 is -0
+        {"x - x", "0-1"},
+    };
+    std::string failures;
+    int saved_stderr = silenceStderr();
+    for (const auto &c : kCases) {
+        std::string text = std::string("def g(x) ") + c.body + "; g(" + c.arg + ");\n";
+        double plain, saturated;
+        egraph_enabled = false;
+        plain = evaluateText(text.c_str());
+        egraph_enabled = true;
+        saturated = evaluateText(text.c_str());
+        if (memcmp(&plain, &saturated, sizeof(double)) != 0)
+            failures += "  " + text.substr(0, text.size() - 1) + " gives " + std::to_string(plain) + " but " +
+                        std::to_string(saturated) + " with --egraph\n";
+    }
+    restoreStderr(saved_stderr);
 
-    return parseBinOpRHS(0, std::move(lhs));
+    fprintf(stderr, "%s%zu e-graph rewrite case(s): %s\n", failures.c_str(), std::size(kCases), failures.empty() ? "ok" : "FAIL");
+    return failures.empty() ? 0 : 1;
 }
 
 /*
-prototype
-    ::= id '(' id* ')'
+checkIpcp - run recursive functions called with constants under --ipcp with every engine, and fail
+unless each gives what the tree engine gives without it. The recursion is deep enough that a tail
+call compiled as a real call overflows the stack. Every run defines its functions under fresh
+names ('$' stands for the run's number), so earlier specializations do not interfere.
 */
-static std::unique_ptr<PrototypeAST> parsePrototype() {
-    if (cur_tok != tok_identifier)
-        return logErrorP("Expected function name in prototype");
-    
-    std::string fn_name = identifier_str;
-    getNextToken();
-
-    if (cur_tok != '(')
-        return logErrorP("Expected '(' in prototype");
-    
-    // read the list of argument names.
-    std::vector<std::string> arg_names;
-    while (getNextToken() == tok_identifier)
-        arg_names.push_back(identifier_str);
-    if (cur_tok != ')')
-        return logErrorP("Expected ')' in prototype");
+static int checkIpcp() {
+    static const char *kCases[] = {
+        "def count$(n k) if n < 1 then k else count$(n-1, 2); def h$(y) count$(y, 2); h$(1000000);",
+        "def count$(n k) if n < 1 then k else count$(n-1, k); def h$(y) count$(y, 7); h$(1000000);",
+        "def count$(n k) if n < 1 then k else count$(n-1, 3); def h$(y) count$(y, 2); h$(5);",
+        "def count$(n k) if n < 1 then k else count$(n-1, k) + 1; def h$(y) count$(y, 7); h$(10);",
+    };
+    std::vector<Engine> engines = {Engine::tree, Engine::linear, Engine::closure};
+#ifdef KALEIDOSCOPE_HAVE_JIT
+    engines.push_back(Engine::jit);
+#endif
+    unsigned run = 0;
+    auto evaluate = [&](const char *text) {
+        std::string named = text;
+        std::string suffix = std::to_string(++run);
+        for (size_t at; (at = named.find('$')) != std::string::npos;)
+            named.replace(at, 1, suffix);
+        return evaluateText(named.c_str());
+    };
 
-    // success
-    getNextToken(); // eat )
+    std::string failures;
+    int saved_stderr = silenceStderr();
+    for (const char *text : kCases) {
+        ipcp_enabled = false;
+        engine = Engine::tree;
+        double expected = evaluate(text);
+        ipcp_enabled = true;
+        for (Engine run_engine : engines) {
+            engine = run_engine;
+            double result = evaluate(text);
+            if (memcmp(&expected, &result, sizeof(double)) != 0)
+                failures += std::string("  ") + text + " gives " + std::to_string(result) + " with --ipcp, not " +
+                            std::to_string(expected) + "\n";
+        }
+    }
+    restoreStderr(saved_stderr);
 
-    return std::make_unique<PrototypeAST>(fn_name, std::move(arg_names));
+    fprintf(stderr, "%s%zu constant propagation case(s): %s\n", failures.c_str(), std::size(kCases), failures.empty() ? "ok" : "FAIL");
+    return failures.empty() ? 0 : 1;
 }
+#endif
 
+//--------------------------------------------------------------
+// Main driver
+//--------------------------------------------------------------
 
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> parseDefinition() {
-    getNextToken(); // eat def
-    auto proto = parsePrototype();
-    if (!proto)
-        return nullptr;
-    
-    if (auto e = parseExpression())
-        return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
-    
-    return nullptr;
-}
+/*
+Options - command line configuration.
+    --metrics-file PATH         rewrite PATH with Prometheus text metrics every interval.
+    --metrics-interval-ms N     interval for --metrics-file (default 10000).
+    --metrics-port N            serve Prometheus text metrics on 127.0.0.1:N.
+    --record PATH               record the input and its arrival times to PATH.
+    --replay PATH               read the input from a recording, under the recorded options.
+    --replay-speed X            replay X times faster than recorded; 0 means no delays (default 1).
+    --slow-threshold-us N       log items whose lex, parse or execute time exceeds N microseconds.
+    --slow-log-size N           keep the N slowest such items (default 32).
+    --slow-log PATH             write the slow-item log to PATH at exit instead of stderr.
+    --check-steady-state N      run N simple expressions and fail if any of them allocates. Covers the default
+                                mode and the engine, cache and reporting options; --egraph, --fast-math,
+                                --slow-threshold-us and --bench-engines allocate per item by design.
+                                Only in builds with -DKALEIDOSCOPE_SELF_CHECKS.
+    --check-latency-batching N  run N simple expressions read one at a time, then N read at once, and fail
+                                if the batched median request latency grows. Only with -DKALEIDOSCOPE_SELF_CHECKS.
+    --check-egraph-exact        fail if --egraph without --fast-math changes the result of any of a set of
+                                expressions that hinge on the sign of zero. Only with -DKALEIDOSCOPE_SELF_CHECKS.
+    --check-ipcp                fail if --ipcp changes the result of a set of recursive functions, or overflows
+                                the stack on tail recursion, with any engine. Only with -DKALEIDOSCOPE_SELF_CHECKS.
+    --latency-report            print request latency percentiles at exit and on SIGUSR1.
+    --dedup                     merge definitions that are identical up to names into one body.
+    --result-cache N            cache the results of up to N pure top-level expressions by structural hash.
+    --window-size N             initial size of the lexer's input window in bytes (default 65536).
+    --engine tree|linear|closure|jit
+                                evaluate by walking the AST (default), sweeping its post-order linearization,
+                                calling its nodes compiled into specialized closures, or running x86-64 code
+                                copied and patched together from per-node stencils.
+    --fast-math                 rewrite expressions in ways that may change rounding: polynomials into Horner
+                                form, operator chains into balanced trees, linear recursion into loops.
+    --poly-form horner|estrin   the form --fast-math rewrites polynomials into (default horner).
+    --egraph                    optimize arithmetic by equality saturation, extracting the cheapest equal form.
+    --egraph-nodes N            stop saturating a region once its e-graph holds N nodes (default 10000), or
+                                32 per node of the region if that is fewer.
+    --egraph-time-ms N          stop saturating a region after N milliseconds (default 10).
+    --ipcp                      specialize functions for the constants all their call sites in definitions pass.
+    --precision double|single   compute in double (default) or float; single reports its error against double at exit.
+    --print-costs               print the estimated operation count of every function defined.
+    --bench-engines N           evaluate each top-level expression N more times with every engine and
+                                print ns and L1 data-cache misses per evaluated node.
+    FILE                        read FILE instead of standard input; it is streamed, never loaded whole.
+                                gzip and zstd files are decompressed on the fly.
+*/
+static struct {
+    std::string metrics_file;
+    unsigned metrics_interval_ms = 10000;
+    int metrics_port = 0;
+    std::string record_file;
+    std::string replay_file;
+    double replay_speed = 1.0;
+    long slow_threshold_us = -1;
+    size_t slow_log_size = 32;
+    std::string slow_log_file;
+#ifdef KALEIDOSCOPE_SELF_CHECKS
+    unsigned check_steady_state = 0;
+    unsigned check_latency_batching = 0;
+    bool check_egraph_exact = false;
+    bool check_ipcp = false;
+#endif
+    bool latency_report = false;
+    bool dedup = false;
+    size_t result_cache = 0;
+    size_t window_size = kDefaultWindowSize;
+    Engine engine = Engine::tree;
+    unsigned bench_engines = 0;
+    bool fast_math = false;
+    bool ipcp = false;
+    bool egraph = false;
+    bool print_costs = false;
+    bool single_precision = false;
+    size_t egraph_nodes = 10000;
+    unsigned egraph_time_ms = 10;
+    PolyForm poly_form = PolyForm::horner;
+    std::string input_file;
+} Options;
 
+static const char *kUsage = "[--metrics-file PATH] [--metrics-interval-ms N] [--metrics-port N] "
+                            "[--record PATH] [--replay PATH] [--replay-speed X] "
+                            "[--slow-threshold-us N] [--slow-log-size N] [--slow-log PATH] "
+#ifdef KALEIDOSCOPE_SELF_CHECKS
+                            "[--check-steady-state N] [--check-latency-batching N] [--check-egraph-exact] [--check-ipcp] "
+#endif
+                            "[--latency-report] [--dedup] [--result-cache N] [--window-size N] "
+                            "[--engine tree|linear|closure|jit] [--bench-engines N] "
+                            "[--fast-math] [--poly-form horner|estrin] [--ipcp] "
+                            "[--egraph] [--egraph-nodes N] [--egraph-time-ms N] [--print-costs] [--precision double|single] [FILE]";
 
-/// topLevelexpr ::= expression
-static std::unique_ptr<FunctionAST> parseTopLevelExpr() {
-    if (auto e = parseExpression()) {
-        // make an anonymous proto.
-        auto proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(proto), std::move(e));
+// parseEngine - the engine named name, if there is one and it runs here.
+static bool parseEngine(const std::string &name, Engine &engine) {
+    static const struct {
+        const char *name;
+        Engine engine;
+    } kEngines[] = {{"tree", Engine::tree}, {"linear", Engine::linear}, {"closure", Engine::closure}, {"jit", Engine::jit}};
+    for (const auto &known : kEngines) {
+        if (name == known.name) {
+#ifndef KALEIDOSCOPE_HAVE_JIT
+            if (known.engine == Engine::jit) {
+                fprintf(stderr, "Error: the jit engine needs x86-64 Linux\n");
+                return false;
+            }
+#endif
+            engine = known.engine;
+            return true;
+        }
     }
-    return nullptr;
+    return false;
 }
 
-
-/// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> parseExtern() {
-    getNextToken(); // eat extern.
-    return parsePrototype();
+static bool parseOptions(const std::vector<std::string> &args) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string &arg = args[i];
+        bool has_value = i + 1 < args.size();
+        if (arg == "--metrics-file" && has_value)
+            Options.metrics_file = args[++i];
+        else if (arg == "--metrics-interval-ms" && has_value)
+            Options.metrics_interval_ms = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--metrics-port" && has_value)
+            Options.metrics_port = atoi(args[++i].c_str());
+        else if (arg == "--record" && has_value)
+            Options.record_file = args[++i];
+        else if (arg == "--replay" && has_value)
+            Options.replay_file = args[++i];
+        else if (arg == "--replay-speed" && has_value)
+            Options.replay_speed = strtod(args[++i].c_str(), nullptr);
+        else if (arg == "--slow-threshold-us" && has_value)
+            Options.slow_threshold_us = strtol(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--slow-log-size" && has_value)
+            Options.slow_log_size = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--slow-log" && has_value)
+            Options.slow_log_file = args[++i];
+#ifdef KALEIDOSCOPE_SELF_CHECKS
+        else if (arg == "--check-steady-state" && has_value)
+            Options.check_steady_state = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--check-latency-batching" && has_value)
+            Options.check_latency_batching = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--check-egraph-exact")
+            Options.check_egraph_exact = true;
+        else if (arg == "--check-ipcp")
+            Options.check_ipcp = true;
+#endif
+        else if (arg == "--latency-report")
+            Options.latency_report = true;
+        else if (arg == "--dedup")
+            Options.dedup = true;
+        else if (arg == "--result-cache" && has_value)
+            Options.result_cache = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--window-size" && has_value)
+            Options.window_size = std::max<size_t>(1, strtoul(args[++i].c_str(), nullptr, 10));
+        else if (arg == "--engine" && has_value && parseEngine(args[i + 1], Options.engine))
+            ++i;
+        else if (arg == "--bench-engines" && has_value)
+            Options.bench_engines = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--fast-math")
+            Options.fast_math = true;
+        else if (arg == "--ipcp")
+            Options.ipcp = true;
+        else if (arg == "--egraph")
+            Options.egraph = true;
+        else if (arg == "--egraph-nodes" && has_value)
+            Options.egraph_nodes = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--egraph-time-ms" && has_value)
+            Options.egraph_time_ms = strtoul(args[++i].c_str(), nullptr, 10);
+        else if (arg == "--print-costs")
+            Options.print_costs = true;
+        else if (arg == "--precision" && has_value && (args[i + 1] == "double" || args[i + 1] == "single"))
+            Options.single_precision = args[++i] == "single";
+        else if (arg == "--poly-form" && has_value && (args[i + 1] == "horner" || args[i + 1] == "estrin"))
+            Options.poly_form = args[++i] == "horner" ? PolyForm::horner : PolyForm::estrin;
+        else if (arg.compare(0, 2, "--") != 0)
+            Options.input_file = arg;
+        else {
+            fprintf(stderr, "Error: unknown option '%s'\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
 }
 
-//---------------------------------------------------------------------
-// Top-Level Parsing
-//---------------------------------------------------------------------
-
-static void handleDefinition() {
-    if (parseDefinition()) {
-        fprintf(stderr, "Parsed a function definition.\n");
+// sessionConfig - the options a recording stores: everything except the record/replay options themselves.
+static std::string sessionConfig(const std::vector<std::string> &args) {
+    std::string config;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--record" || args[i] == "--replay" || args[i] == "--replay-speed") {
+            ++i;
+            continue;
+        }
+        if (!config.empty())
+            config += ' ';
+        // escaped, so values such as paths with spaces come back as one word.
+        for (char c : args[i]) {
+            switch (c) {
+                case '\\': config += "\\\\"; break;
+                case ' ': config += "\\s"; break;
+                case '\n': config += "\\n"; break;
+                default: config += c; break;
+            }
+        }
     }
-    else {
-        // skip token for error recovery.
-        getNextToken();
+    return config;
+}
+
+// splitWords - the words of a recorded config, with sessionConfig()'s escapes undone.
+static std::vector<std::string> splitWords(const std::string &str) {
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while ((pos = str.find_first_not_of(' ', pos)) != std::string::npos) {
+        std::string word;
+        for (; pos < str.size() && str[pos] != ' '; ++pos) {
+            if (str[pos] == '\\' && pos + 1 < str.size()) {
+                char escaped = str[++pos];
+                word += escaped == 's' ? ' ' : escaped == 'n' ? '\n' : escaped;
+            }
+            else
+                word += str[pos];
+        }
+        words.push_back(word);
     }
+    return words;
 }
 
-static void handleExtern() {
-    if (parseExtern()) {
-        fprintf(stderr, "Parsed an extern\n");
+int main(int argc, char **argv) {
+    selectScanKernel();
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (!parseOptions(args)) {
+        fprintf(stderr, "Usage: %s %s\n", argv[0], kUsage);
+        return 1;
     }
-    else {
-        // skip token for error recovery.
-        getNextToken();
+
+    window.resize(Options.window_size);
+
+    int input_fd = STDIN_FILENO;
+    if (!Options.input_file.empty() && Options.replay_file.empty()) {
+        input_fd = open(Options.input_file.c_str(), O_RDONLY);
+        if (input_fd < 0) {
+            fprintf(stderr, "Error: cannot open '%s'\n", Options.input_file.c_str());
+            return 1;
+        }
     }
-}
+    FdSource fd_source(input_fd);
+    input = &fd_source;
 
-static void handleTopLevelExpression() {
-    // evaluate a top-level expression into an anonymous function.
-    if (parseTopLevelExpr()) {
-        fprintf(stderr, "Parsed a top-level expr\n");
+    std::unique_ptr<DecompressSource> decompress;
+    Compression compression = input_fd == STDIN_FILENO ? Compression::none : compressionOf(input_fd);
+    if (compression != Compression::none) {
+        decompress = std::make_unique<DecompressSource>(input_fd, compression);
+        input = decompress.get();
     }
-    else {
-        // skip token for error recovery.
-        getNextToken();
+
+    std::unique_ptr<ReplaySource> replay;
+    if (!Options.replay_file.empty()) {
+        FILE *f = fopen(Options.replay_file.c_str(), "rb");
+        if (!f) {
+            fprintf(stderr, "Error: cannot open recording '%s'\n", Options.replay_file.c_str());
+            return 1;
+        }
+        replay = std::make_unique<ReplaySource>(f, Options.replay_speed);
+        std::string config;
+        if (!replay->readHeader(config)) {
+            fprintf(stderr, "Error: '%s' is not a recording\n", Options.replay_file.c_str());
+            return 1;
+        }
+        // the recorded options apply first, anything given on this command line overrides them.
+        if (!parseOptions(splitWords(config)) || !parseOptions(args))
+            return 1;
+        input = replay.get();
     }
-}
 
-/// top ::= definition | external | expression | ';'
-static void mainLoop() {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (cur_tok) {
-            case tok_eof:
-                return;
-            case ';': // ignore top-level semicolons.
-                getNextToken();
-                break;
-            case tok_def:
-                handleDefinition();
-                break;
-            case tok_extern:
-                handleExtern();
-                break;
-            default:
-                handleTopLevelExpression();
-                break;
+    std::unique_ptr<RecordingSource> recording;
+    if (!Options.record_file.empty()) {
+        FILE *f = fopen(Options.record_file.c_str(), "wb");
+        if (!f) {
+            fprintf(stderr, "Error: cannot create recording '%s'\n", Options.record_file.c_str());
+            return 1;
         }
+        recording = std::make_unique<RecordingSource>(*input, f, sessionConfig(args));
+        input = recording.get();
     }
-}
 
+    result_cache_capacity = Options.result_cache;
+    dedup_enabled = Options.dedup;
+    engine = Options.engine;
+    bench_iterations = Options.bench_engines;
+    fast_math = Options.fast_math;
+    ipcp_enabled = Options.ipcp;
+    egraph_enabled = Options.egraph;
+    egraph_node_limit = Options.egraph_nodes;
+    egraph_time_ms = Options.egraph_time_ms;
+    print_costs = Options.print_costs;
+    single_precision = Options.single_precision;
+    poly_form = Options.poly_form;
+    if (Options.slow_threshold_us >= 0 && Options.slow_log_size)
+        SlowLog.enable(Options.slow_threshold_us, Options.slow_log_size);
 
-//--------------------------------------------------------------
-// Main driver
-//--------------------------------------------------------------
+    if (Options.latency_report)
+        signal(SIGUSR1, requestLatencyReport);
+
+    MetricsExporter exporter;
+    if (!Options.metrics_file.empty())
+        exporter.startFile(Options.metrics_file, Options.metrics_interval_ms ? Options.metrics_interval_ms : 1);
+    if (Options.metrics_port && !exporter.startSocket(Options.metrics_port))
+        fprintf(stderr, "Error: cannot listen on 127.0.0.1:%d for metrics\n", Options.metrics_port);
 
-int main() {
     // Install standard binary operators.
     // 1 is lowest precedence.
     BinopPrecedence['<'] = 10;
@@ -448,6 +5672,17 @@ int main() {
     BinopPrecedence['-'] = 20;
     BinopPrecedence['*'] = 40; // highest
 
+#ifdef KALEIDOSCOPE_SELF_CHECKS
+    if (Options.check_steady_state)
+        return checkSteadyStateAllocations(Options.check_steady_state);
+    if (Options.check_latency_batching)
+        return checkLatencyBatching(Options.check_latency_batching);
+    if (Options.check_egraph_exact)
+        return checkEgraphExact();
+    if (Options.check_ipcp)
+        return checkIpcp();
+#endif
+
     // prime the first token.
     fprintf(stderr, "ready> ");
     getNextToken();
@@ -455,5 +5690,36 @@ int main() {
     // run the main "Interpreter Loop" now
     mainLoop();
 
+    if (SlowLog.enabled()) {
+        FILE *out = Options.slow_log_file.empty() ? stderr : fopen(Options.slow_log_file.c_str(), "w");
+        if (out) {
+            SlowLog.report(out);
+            if (out != stderr)
+                fclose(out);
+        }
+        else
+            fprintf(stderr, "Error: cannot write slow-item log '%s'\n", Options.slow_log_file.c_str());
+    }
+
+    if (Options.latency_report)
+        reportLatency(stderr);
+    if (dedup_enabled)
+        fprintf(stderr, "dedup: merged %u of %u function definitions\n", dedup_merged, dedup_definitions);
+    if (fast_math)
+        fprintf(stderr, "fast-math: rewrote %u polynomial(s); %llu multiplies before, %llu after; rebalanced %u chain(s); "
+                "%u recursion(s) made tail recursive\n",
+                poly_rewritten, (unsigned long long)fast_math_multiplies_before, (unsigned long long)fast_math_multiplies_after,
+                chains_rebalanced, recursions_converted);
+    if (egraph_enabled)
+        fprintf(stderr, "egraph: %u region(s), %u improved, %u hit a limit; cost %llu before, %llu after\n", egraph_regions,
+                egraph_improved, egraph_limited, (unsigned long long)egraph_cost_before, (unsigned long long)egraph_cost_after);
+    if (single_precision)
+        fprintf(stderr, "precision: single; %llu result(s) compared with double: max abs error %g, max rel error %g, mean rel error %g\n",
+                (unsigned long long)PrecisionReport.compared, PrecisionReport.max_abs_error, PrecisionReport.max_rel_error,
+                PrecisionReport.compared ? PrecisionReport.sum_rel_error / PrecisionReport.compared : 0.0);
+    if (ipcp_enabled)
+        fprintf(stderr, "ipcp: %zu specialization(s), %u call site(s) rewritten\n", Specializations.size(), ipcp_call_sites);
+
+    exporter.stop();
     return 0;
 }
\ No newline at end of file